@@ -0,0 +1,509 @@
+#!/bin/sh
+#
+# Benchmarks the tools against their GNU counterparts.
+#
+#   bench/bench.sh [options] [case...]
+#
+#   -B dir    tools to benchmark (build/release)
+#   -d dir    fixtures and scratch space (build/bench)
+#   -o file   results (build/bench/results.json)
+#   -b file   baseline to check the results against (bench/baseline.json)
+#   -s        store the results as the new baseline
+#   -r runs   recorded runs per command (5)
+#   -w runs   unrecorded warmup runs per command (1)
+#   -S MiB    size of the large file (128)
+#   -j n      threads for the tools that take them (all CPUs)
+#   -t pct    slowdown considered a regression (5)
+#   -l        list the cases and exit
+#
+# Cases are picked by prefix: 'bench/bench.sh ls cp/tree' runs every
+# ls case and cp/tree. Every case is timed by time -c, which runs our
+# tool and the GNU one interleaved and reports both with a Welch test.
+#
+# Fixtures are generated from a fixed seed by a Park-Miller generator
+# in awk, so every machine gets the same bytes. They are generated once
+# per seed and size and reused until the parameters change.
+#
+# A regression is a case whose time relative to GNU grew by more than
+# the threshold and more than the combined 95% confidence interval.
+# Comparing ratios rather than raw times keeps a baseline meaningful
+# on a loaded or a different machine, as long as GNU is the same.
+#
+
+set -eu
+
+BIN=build/release
+DIR=build/bench
+OUT=
+BASELINE=bench/baseline.json
+SAVE=
+RUNS=5
+WARMUP=1
+SIZE=128
+THREADS=$(getconf _NPROCESSORS_ONLN)
+THRESHOLD=5
+LIST=
+SEED=49
+
+# Number of cats in the megacat chain
+CHAIN=4
+# Elements for thread_sort
+SORT_COUNT=1000000
+
+usage()
+{
+        sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2
+        exit 2
+}
+
+while getopts B:d:o:b:sr:w:S:j:t:l opt; do
+        case $opt in
+        B) BIN=$OPTARG ;;
+        d) DIR=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        s) SAVE=1 ;;
+        r) RUNS=$OPTARG ;;
+        w) WARMUP=$OPTARG ;;
+        S) SIZE=$OPTARG ;;
+        j) THREADS=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        l) LIST=1 ;;
+        *) usage ;;
+        esac
+done
+shift $((OPTIND - 1))
+
+: "${OUT:=$DIR/results.json}"
+
+# Same collation and messages for both sides
+LC_ALL=C
+export LC_ALL
+
+BIN=$(cd "$BIN" && pwd)
+mkdir -p "$DIR"
+DIR=$(cd "$DIR" && pwd)
+FIX=$DIR/fixtures
+SCRATCH=$DIR/scratch
+
+GNU_CAT=$(command -v cat)
+GNU_CP=$(command -v cp)
+GNU_WC=$(command -v wc)
+GNU_LS=$(command -v ls)
+GNU_DU=$(command -v du)
+GNU_SORT=$(command -v sort)
+
+#
+# Fixtures
+#
+
+# Park-Miller minimal standard generator, exact in double arithmetic
+RNG='function rnd(n) { x = (x * 16807) % 2147483647; return x % n }'
+
+# About 1MiB of lowercase words and lines of 0-15 words
+gen_text()
+{
+        awk -v x="$SEED" "$RNG"'
+        BEGIN {
+                for (i = 0; i < 4096; i++) {
+                        w = ""
+                        for (n = 1 + rnd(12); n; n--)
+                                w = w sprintf("%c", 97 + rnd(26))
+                        vocab[i] = w
+                }
+                for (size = 0; size < 1048576; size += length(line) + 1) {
+                        line = ""
+                        for (n = rnd(16); n; n--)
+                                line = line (line == "" ? "" : " ") vocab[rnd(4096)]
+                        print line
+                }
+        }'
+}
+
+# $1 directories of $2 files, 0-8KiB each
+gen_small()
+{
+        awk -v x="$SEED" -v dirs="$1" -v files="$2" -v root="$3" "$RNG"'
+        BEGIN {
+                text = ""
+                while (length(text) < 8192)
+                        text = text sprintf("%c", rnd(10) ? 97 + rnd(26) : 10)
+                for (d = 0; d < dirs; d++) {
+                        dir = sprintf("%s/d%03d", root, d)
+                        system("mkdir -p " dir)
+                        for (f = 0; f < files; f++) {
+                                path = sprintf("%s/f%04d", dir, f)
+                                printf "%s", substr(text, 1, rnd(8192)) > path
+                                close(path)
+                        }
+                }
+        }'
+}
+
+#
+# Fanout 4, depth 6 with 3 files in every directory, and beside it a
+# chain of 128 nested directories with one file each. The walk runs
+# twice: first it lists the directories for mkdir, then fills them.
+#
+TREE='
+function file(path) {
+        if (mode == "files") {
+                printf "%s", substr(text, 1, rnd(4096)) > path
+                close(path)
+        }
+}
+BEGIN {
+        text = ""
+        while (length(text) < 4096)
+                text = text sprintf("%c", rnd(10) ? 97 + rnd(26) : 10)
+        n = 1
+        queue[0] = "wide"
+        depth[0] = 0
+        for (i = 0; i < n; i++) {
+                if (mode == "dirs")
+                        print queue[i]
+                for (f = 0; f < 3; f++)
+                        file(queue[i] "/f" f)
+                if (depth[i] == 6)
+                        continue
+                for (c = 0; c < 4; c++) {
+                        queue[n] = queue[i] "/" c
+                        depth[n++] = depth[i] + 1
+                }
+        }
+        deep = "deep"
+        for (i = 0; i < 128; i++)
+                deep = deep "/l"
+        if (mode == "dirs")
+                print deep
+        for (deep = "deep"; i; i--) {
+                deep = deep "/l"
+                file(deep "/f")
+        }
+}'
+
+gen_tree()
+{
+        mkdir -p "$1"
+        (
+                cd "$1"
+                awk -v x="$SEED" -v mode=dirs "$RNG$TREE" | xargs mkdir -p
+                awk -v x="$SEED" -v mode=files "$RNG$TREE"
+        )
+}
+
+# 1GiB with a 1MiB data extent every 64MiB
+gen_sparse()
+{
+        truncate -s 1G "$1"
+        for i in 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15; do
+                dd if="$FIX/block.txt" of="$1" bs=1M count=1 seek=$((i * 64)) \
+                   conv=notrunc status=none
+        done
+}
+
+gen_numbers()
+{
+        awk -v x="$SEED" -v n="$1" "$RNG"'
+        BEGIN { for (i = 0; i < n; i++) print rnd(20) }'
+}
+
+fixtures()
+{
+        stamp="seed $SEED size $SIZE sort $SORT_COUNT"
+        if [ "$(cat "$FIX/stamp" 2>/dev/null)" = "$stamp" ]; then
+                return
+        fi
+
+        echo "Generating fixtures in $FIX" >&2
+        rm -rf "$FIX"
+        mkdir -p "$FIX"
+
+        gen_text > "$FIX/block.txt"
+        : > "$FIX/large.txt"
+        i=0
+        while [ $i -lt "$SIZE" ]; do
+                cat "$FIX/block.txt" >> "$FIX/large.txt"
+                i=$((i + 1))
+        done
+
+        gen_sparse "$FIX/sparse.img"
+        gen_small 100 100 "$FIX/small"
+        gen_tree "$FIX/tree"
+        gen_numbers "$SORT_COUNT" > "$FIX/numbers.txt"
+
+        echo "$stamp" > "$FIX/stamp"
+}
+
+#
+# Cases
+#
+
+CASES="cat/large cat/sparse cat/small monitor/large megacat/large
+       wc/large wc/large-threads wc/small cp/large cp/sparse cp/tree
+       cp/small cp/link ls/tree ls/small ls/summarize thread_sort/threads"
+
+# time -c arguments: our command, '--', the GNU one
+case_args()
+{
+        large=$FIX/large.txt
+        sparse=$FIX/sparse.img
+        dst=$SCRATCH/dst
+
+        case $1 in
+        cat/large)
+                set -- "$BIN/cat" "$large" -- "$GNU_CAT" "$large" ;;
+        cat/sparse)
+                set -- "$BIN/cat" "$sparse" -- "$GNU_CAT" "$sparse" ;;
+        cat/small)
+                set -- sh -c 'exec "$0" "$1"/*/*' "$BIN/cat" "$FIX/small" -- \
+                       sh -c 'exec "$0" "$1"/*/*' "$GNU_CAT" "$FIX/small" ;;
+        monitor/large)
+                set -- "$BIN/monitor" "$large" -- "$GNU_CAT" "$large" ;;
+        megacat/large)
+                #
+                # megacat never exits on its own: it keeps polling the
+                # chain after the input ends. Stop it once the whole
+                # input has come out of the other end.
+                #
+                fifo=$SCRATCH/megacat
+                [ -p "$fifo" ] || mkfifo "$fifo"
+                size=$(wc -c < "$large")
+                chain=$(i=1; while [ $i -lt $CHAIN ]; do printf ' | "$0"'; i=$((i + 1)); done)
+                set -- sh -c '"$0" "$1" "$2" < "$3" > "$4" & head -c "$5" < "$4"; kill $!; wait' \
+                          "$BIN/megacat" "$GNU_CAT" "$CHAIN" "$large" "$fifo" "$size" -- \
+                       sh -c '"$0" < "$1"'"$chain" "$GNU_CAT" "$large" ;;
+        wc/large)
+                set -- "$BIN/wc" -f "$large" -- "$GNU_WC" "$large" ;;
+        wc/large-threads)
+                set -- "$BIN/wc" -j "$THREADS" -f "$large" -- "$GNU_WC" "$large" ;;
+        wc/small)
+                set -- sh -c 'exec "$0" -f "$1"/*/*' "$BIN/wc" "$FIX/small" -- \
+                       sh -c 'exec "$0" "$1"/*/*' "$GNU_WC" "$FIX/small" ;;
+        cp/large | cp/sparse)
+                src=$large
+                [ "$1" = cp/sparse ] && src=$sparse
+                set -- sh -c 'rm -f "$2"; exec "$0" "$1" "$2"' "$BIN/cp" "$src" "$dst" -- \
+                       sh -c 'rm -f "$2"; exec "$0" "$1" "$2"' "$GNU_CP" "$src" "$dst" ;;
+        cp/tree | cp/small)
+                src=$FIX/${1#cp/}
+                set -- sh -c 'rm -rf "$2"; exec "$0" -r "$1" "$2"' "$BIN/cp" "$src" "$dst" -- \
+                       sh -c 'rm -rf "$2"; exec "$0" -r "$1" "$2"' "$GNU_CP" "$src" "$dst" ;;
+        cp/link)
+                #
+                # The tree through a symlink operand, which is followed
+                # like cp -H does. A failed copy fails the case.
+                #
+                src=$SCRATCH/link
+                [ -L "$src" ] || ln -s "$FIX/tree" "$src"
+                set -- sh -c 'rm -rf "$2"; exec "$0" -r "$1" "$2"' "$BIN/cp" "$src" "$dst" -- \
+                       sh -c 'rm -rf "$2"; exec "$0" -rH "$1" "$2"' "$GNU_CP" "$src" "$dst" ;;
+        ls/tree | ls/small)
+                src=$FIX/${1#ls/}
+                set -- "$BIN/ls" -Rl "$src" -- "$GNU_LS" -Rl "$src" ;;
+        ls/summarize)
+                set -- "$BIN/ls" --summarize "$FIX/tree" -- "$GNU_DU" "$FIX/tree" ;;
+        thread_sort/threads)
+                #
+                # Not the same work: thread_sort sorts random ints it
+                # generates itself, sort parses as many from text.
+                # Still the nearest thing GNU has.
+                #
+                set -- sh -c 'exec "$0" "$1" "$2" 2> /dev/null' \
+                          "$BIN/thread_sort" "$SORT_COUNT" "$THREADS" -- \
+                       sh -c 'exec "$0" -n --parallel="$2" "$1"' \
+                          "$GNU_SORT" "$FIX/numbers.txt" "$THREADS" ;;
+        *)
+                return 1 ;;
+        esac
+
+        for arg; do
+                printf '%s\n' "$arg"
+        done
+}
+
+selected()
+{
+        [ $# -eq 0 ] && return 0
+        for pick; do
+                case $name in
+                "$pick"*) return 0 ;;
+                esac
+        done
+        return 1
+}
+
+#
+# Results
+#
+
+json_str()
+{
+        printf '"%s"' "$(printf '%s' "$1" | sed 's/[\\"]/\\&/g')"
+}
+
+host()
+{
+        cpu=$(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo | head -n 1)
+        mem=$(sed -n 's/^MemTotal: *\([0-9]*\) kB/\1/p' /proc/meminfo)
+        gov=$(cat /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor 2>/dev/null || echo unknown)
+        commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+        if ! git diff --quiet HEAD 2>/dev/null; then
+                commit="$commit-dirty"
+        fi
+
+        printf '"host": {"cpu": %s, "cpus": %s, "mem_kib": %s, "governor": %s, ' \
+               "$(json_str "$cpu")" "$(getconf _NPROCESSORS_ONLN)" "${mem:-0}" \
+               "$(json_str "$gov")"
+        printf '"kernel": %s, "arch": %s, "fs": %s, "cc": %s},\n' \
+               "$(json_str "$(uname -sr)")" "$(json_str "$(uname -m)")" \
+               "$(json_str "$(stat -f -c %T "$DIR")")" \
+               "$(json_str "$(${CC:-cc} --version 2>/dev/null | head -n 1)")"
+        printf '"run": {"date": %s, "commit": %s, "bin": %s, "runs": %s, ' \
+               "$(json_str "$(date -u +%Y-%m-%dT%H:%M:%SZ)")" "$(json_str "$commit")" \
+               "$(json_str "$BIN")" "$RUNS"
+        printf '"warmup": %s, "seed": %s, "size_mib": %s, "threads": %s},\n' \
+               "$WARMUP" "$SEED" "$SIZE" "$THREADS"
+}
+
+#
+# One result per line, so that awk can pick them up without a JSON
+# parser. Ours is the first of the two benchmarks, GNU the second.
+#
+SUMMARY='
+function nth(s, key, n,    p) {
+        for (; n; n--) {
+                p = index(s, "\"" key "\": ")
+                if (!p)
+                        return -1
+                s = substr(s, p + length(key) + 4)
+        }
+        return s + 0
+}
+function name(s) {
+        s = substr(s, index(s, "\"case\": \"") + 9)
+        return substr(s, 1, index(s, "\"") - 1)
+}
+# Ratio of ours to GNU and its relative 95% error
+function ratio(s, r) {
+        r["ours"] = nth(s, "mean", 1)
+        r["gnu"] = nth(s, "mean", 2)
+        r["ok"] = nth(s, "status", 1) == 0 && nth(s, "status", 2) == 0 && r["gnu"] > 0
+        if (!r["ok"])
+                return
+        r["ratio"] = r["ours"] / r["gnu"]
+        r["err"] = sqrt((nth(s, "ci95", 1) / r["ours"]) ^ 2 + (nth(s, "ci95", 2) / r["gnu"]) ^ 2)
+}
+'
+
+summary()
+{
+        awk -v threshold="$THRESHOLD" -v baseline="${1:-}" "$SUMMARY"'
+        BEGIN {
+                if (baseline != "") {
+                        while ((getline line < baseline) > 0) {
+                                if (line ~ /^"host"/)
+                                        base_cpu = substr(line, 1, index(line, ", \"cpus\""))
+                                if (line !~ /"case"/)
+                                        continue
+                                ratio(line, r)
+                                if (r["ok"]) {
+                                        base[name(line)] = r["ratio"]
+                                        base_err[name(line)] = r["err"]
+                                }
+                        }
+                }
+                printf "%-22s %10s %10s %7s", "case", "ours ms", "gnu ms", "ratio"
+                if (baseline != "")
+                        printf " %7s %8s", "base", "change"
+                printf "\n"
+        }
+        /^"host"/ {
+                if (baseline != "" && base_cpu != substr($0, 1, index($0, ", \"cpus\"")))
+                        note = "note: baseline was recorded on another CPU"
+        }
+        /"case"/ {
+                c = name($0)
+                ratio($0, r)
+                if (!r["ok"]) {
+                        printf "%-22s FAILED\n", c
+                        failed++
+                        next
+                }
+                printf "%-22s %10.2f %10.2f %7.3f", c, r["ours"] / 1e6, r["gnu"] / 1e6, r["ratio"]
+                if (c in base) {
+                        change = r["ratio"] / base[c] - 1
+                        err = sqrt(r["err"] ^ 2 + base_err[c] ^ 2)
+                        printf " %7.3f %+7.1f%%", base[c], 100 * change
+                        if (change > threshold / 100 && change > err) {
+                                printf "  REGRESSION"
+                                regressed++
+                        } else if (-change > threshold / 100 && -change > err) {
+                                printf "  improved"
+                        }
+                }
+                printf "\n"
+        }
+        END {
+                if (note != "")
+                        print note
+                if (regressed)
+                        printf "%d regression(s) against %s\n", regressed, baseline
+                exit (failed || regressed) ? 1 : 0
+        }'
+}
+
+if [ -n "$LIST" ]; then
+        for name in $CASES; do
+                echo "$name"
+        done
+        exit 0
+fi
+
+fixtures
+mkdir -p "$SCRATCH"
+
+tmp=$DIR/case.json
+{
+        echo "{"
+        host
+        echo '"results": ['
+        sep=
+        for name in $CASES; do
+                selected "$@" || continue
+                echo "$name" >&2
+
+                # Arguments are one per line, none of ours has a newline
+                args=$(case_args "$name")
+                old_ifs=$IFS
+                IFS='
+'
+                set -f
+                # shellcheck disable=SC2086
+                "$BIN/time" -j -o "$tmp" -r "$RUNS" -w "$WARMUP" -x -c $args \
+                        < /dev/null > /dev/null
+                set +f
+                IFS=$old_ifs
+
+                printf '%s{"case": %s, %s' "$sep" "$(json_str "$name")" "$(tail -c +2 "$tmp")"
+                sep=',
+'
+        done
+        printf '\n]}\n'
+} > "$OUT.tmp"
+mv "$OUT.tmp" "$OUT"
+rm -rf "$tmp" "$SCRATCH"
+
+echo "Results in $OUT" >&2
+
+status=0
+if [ -n "$SAVE" ]; then
+        cp "$OUT" "$BASELINE"
+        echo "Stored as the baseline in $BASELINE" >&2
+        summary < "$OUT" || status=$?
+elif [ -f "$BASELINE" ]; then
+        summary "$BASELINE" < "$OUT" || status=$?
+else
+        summary < "$OUT" || status=$?
+fi
+exit $status
@@ -1,12 +1,19 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <libgen.h>
-#include <sys/mman.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <linux/limits.h>
 #include <sys/stat.h>
 
 int
@@ -29,103 +36,1090 @@ indicate_errno()
         return saved_errno;
 }
 
+/* Files smaller than this are copied by a single thread */
+#define CP_CHUNK_MIN (64 << 20)
+#define CP_BUFSZ     (1 << 20)
+
+static struct {
+        int interactive;
+        int force;
+        int verbose;
+        int fsync;
+        int recursive;
+        int preserve;
+        int progress;
+        int resume;
+        int verify;
+        long n_threads;
+} opts = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/**
+ * Progress accounting. Every copy path adds the bytes it has finished,
+ * skipped holes and already journaled chunks included,
+ * so the rate and ETA reflect the remaining work.
+ */
+static struct {
+        atomic_llong done;
+        off_t total;
+        atomic_int stop;
+        struct timespec start;
+} progress;
+
+static inline void
+progress_add(off_t n_bytes)
+{
+        if (opts.progress)
+                atomic_fetch_add_explicit(&progress.done, n_bytes, memory_order_relaxed);
+}
+
+static int
+is_unsupported(int error)
+{
+        /**
+         * copy_file_range() refuses cross-filesystem copies on older kernels,
+         * special files and filesystems without support.
+         */
+        return error == EXDEV  || error == EINVAL || error == ENOSYS ||
+               error == EOPNOTSUPP || error == EBADF;
+}
+
+/**
+ * Copy [off, off + len) with explicit offsets, so ranges
+ * of the same file pair may be copied concurrently.
+ *
+ * Prefer copy_file_range(): data stays in the kernel and the filesystem
+ * may reflink or do a server-side copy. Fall back to large pread/pwrite.
+ *
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
+int
+copy_range(int src_fd, int dst_fd, off_t off, off_t len)
+{
+        off_t src_off = off;
+        off_t dst_off = off;
+        off_t end = off + len;
+
+        while (src_off < end) {
+                ssize_t n_copied = copy_file_range(src_fd, &src_off, dst_fd, &dst_off,
+                                                   end - src_off, 0);
+                if (n_copied == -1 && errno == EINTR)
+                        continue;
+                if (n_copied == -1 && is_unsupported(errno))
+                        break;
+                if (n_copied == -1)
+                        return errno;
+
+                /* Source got truncated under us */
+                if (n_copied == 0)
+                        return 0;
+
+                progress_add(n_copied);
+        }
+
+        if (src_off == end)
+                return 0;
+
+        char *buf = malloc(CP_BUFSZ);
+        if (!buf)
+                return errno;
+
+        while (src_off < end) {
+                size_t n_want = (end - src_off < CP_BUFSZ) ? end - src_off : CP_BUFSZ;
+                ssize_t n_read = pread(src_fd, buf, n_want, src_off);
+                if (n_read == -1 && errno == EINTR)
+                        continue;
+                if (n_read <= 0)
+                        return free(buf), (n_read ? errno : 0);
+
+                for (ssize_t n_left = n_read; n_left;) {
+                        ssize_t n_written = pwrite(dst_fd, buf + n_read - n_left, n_left,
+                                                   dst_off + n_read - n_left);
+                        if (n_written == -1 && errno == EINTR)
+                                continue;
+                        if (n_written == -1)
+                                return free(buf), errno;
+
+                        n_left -= n_written;
+                }
+
+                src_off += n_read;
+                dst_off += n_read;
+                progress_add(n_read);
+        }
+
+        free(buf);
+        return 0;
+}
+
+/**
+ * Copy until end of file for sources which size is not known
+ * in advance: pipes, character devices, procfs files.
+ */
+int
+copy_stream(int src_fd, int dst_fd)
+{
+        char *buf = malloc(CP_BUFSZ);
+        if (!buf)
+                return errno;
+
+        ssize_t n_read = 0;
+        do {
+                n_read = read(src_fd, buf, CP_BUFSZ);
+                if (n_read == -1 && errno == EINTR)
+                        continue;
+                if (n_read == -1)
+                        return free(buf), errno;
+
+                for (ssize_t n_left = n_read; n_left;) {
+                        ssize_t n_written = write(dst_fd, buf + n_read - n_left, n_left);
+                        if (n_written == -1 && errno == EINTR)
+                                continue;
+                        if (n_written == -1)
+                                return free(buf), errno;
+
+                        n_left -= n_written;
+                }
+
+                progress_add(n_read);
+        } while (n_read);
+
+        free(buf);
+        return 0;
+}
+
+struct range {
+        int src_fd;
+        int dst_fd;
+        off_t off;
+        off_t len;
+        int error;
+};
+
+void *
+load_range(void *args_p)
+{
+        struct range *range = (struct range *)args_p;
+        range->error = copy_range(range->src_fd, range->dst_fd, range->off, range->len);
+        return NULL;
+}
+
+/**
+ * Split [start, start + size) into disjoint ranges copied by separate threads.
+ * Range sizes are multiples of CP_BUFSZ to keep page cache and extents happy.
+ */
+int
+copy_parallel(int src_fd, int dst_fd, off_t start, off_t size)
+{
+        size_t n_ranges = size / CP_CHUNK_MIN;
+        if (n_ranges > (size_t)opts.n_threads)
+                n_ranges = opts.n_threads;
+        if (n_ranges < 2)
+                return copy_range(src_fd, dst_fd, start, size);
+
+        struct range *ranges = calloc(n_ranges, sizeof(struct range));
+        pthread_t *tids = calloc(n_ranges, sizeof(pthread_t));
+        if (!ranges || !tids)
+                return free(ranges), free(tids), errno;
+
+        off_t range_sz = (size / (off_t)n_ranges + CP_BUFSZ - 1) & ~(off_t)(CP_BUFSZ - 1);
+        for (size_t i = 0; i != n_ranges; i++) {
+                off_t off = (off_t)i * range_sz < size ? (off_t)i * range_sz : size;
+                off_t end = off + range_sz < size ? off + range_sz : size;
+                if (i == n_ranges - 1)
+                        end = size;
+
+                ranges[i] = (struct range) {
+                        .src_fd = src_fd,
+                        .dst_fd = dst_fd,
+                        .off = start + off,
+                        .len = end - off,
+                };
+        }
+
+        /* Ranges we could not start a thread for are copied here */
+        size_t n_started = 0;
+        for (; n_started != n_ranges; n_started++)
+                if (pthread_create(&tids[n_started], NULL, load_range, &ranges[n_started]))
+                        break;
+
+        for (size_t i = n_started; i != n_ranges; i++)
+                load_range(&ranges[i]);
+
+        for (size_t i = 0; i != n_started; i++)
+                pthread_join(tids[i], NULL);
+
+        int error = 0;
+        for (size_t i = 0; i != n_ranges && !error; i++)
+                error = ranges[i].error;
+
+        free(ranges);
+        free(tids);
+        return error;
+}
+
+/**
+ * Copy only allocated extents of [start, end) of the source,
+ * found with SEEK_DATA/SEEK_HOLE. Destination is expected to be truncated
+ * to the full size beforehand, so skipped ranges stay holes there too.
+ *
+ * Filesystems without SEEK_DATA support get the whole range as one extent.
+ */
+int
+copy_sparse(int src_fd, int dst_fd, off_t start, off_t end, off_t *transferred)
+{
+        assert(transferred);
+        *transferred = 0;
+
+        for (off_t off = start; off < end;) {
+                off_t data = lseek(src_fd, off, SEEK_DATA);
+                if ((data == -1 && errno == ENXIO) || data >= end) {
+                        progress_add(end - off);
+                        break;
+                }
+                if (data == -1)
+                        data = off;
+
+                off_t hole = lseek(src_fd, data, SEEK_HOLE);
+                if (hole == -1 || hole > end)
+                        hole = end;
+
+                int error = copy_parallel(src_fd, dst_fd, data, hole - data);
+                if (error)
+                        return error;
+
+                progress_add(data - off);
+                *transferred += hole - data;
+                off = hole;
+        }
+
+        return 0;
+}
+
+/**
+ * Copy data between opened files and apply opt-in fsync.
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
+int
+copy_fd(int src_fd, int dst_fd, const struct stat *src_st, const char *src_nm)
+{
+        assert(src_st && src_nm);
+
+        int error = 0;
+        off_t transferred = 0;
+        if (!S_ISREG(src_st->st_mode) || src_st->st_size == 0) {
+                error = copy_stream(src_fd, dst_fd);
+        } else {
+                /**
+                 * Set final size at once: parallel ranges never extend the file
+                 * and everything we skip is a hole already.
+                 */
+                if (ftruncate(dst_fd, src_st->st_size) == -1)
+                        error = errno;
+                else
+                        error = copy_sparse(src_fd, dst_fd, 0, src_st->st_size, &transferred);
+
+                if (!error && opts.verbose)
+                        fprintf(stderr, "%s: %jd of %jd bytes transferred, %jd in holes\n",
+                                src_nm, (intmax_t)transferred, (intmax_t)src_st->st_size,
+                                (intmax_t)(src_st->st_size - transferred));
+        }
+
+        /* Durability is opt-in: full sync costs more than the copy itself */
+        if (!error && opts.fsync && fsync(dst_fd) == -1)
+                error = errno;
+
+        return error;
+}
+
+/**
+ * Apply source ownership, mode and times to the destination.
+ * Owner goes first: chown() drops setuid/setgid bits.
+ * Changing owner is allowed to fail for unprivileged users.
+ */
+int
+preserve(int dst_fd, const struct stat *src_st)
+{
+        assert(src_st);
+
+        if (fchown(dst_fd, src_st->st_uid, src_st->st_gid) == -1 && errno != EPERM)
+                return errno;
+
+        if (fchmod(dst_fd, src_st->st_mode & 07777) == -1)
+                return errno;
+
+        const struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+        if (futimens(dst_fd, times) == -1)
+                return errno;
+
+        return 0;
+}
+
+/**
+ * Resumable copy.
+ *
+ * File is split into CP_JOURNAL_CHUNK chunks. Completed chunks are recorded
+ * in a sidecar journal '<dst>.mycp-journal' next to the destination:
+ *
+ *      struct journal_hdr
+ *      struct journal_rec [n_chunks]
+ *
+ * Records have fixed offsets, so workers update them with a single pwrite().
+ * A chunk is marked done only after its data is flushed with fdatasync().
+ * The journal is valid only for the same source size and mtime, and for
+ * the same destination: its device, inode and size are recorded too, so
+ * a destination that was deleted, replaced or truncated since is copied
+ * from scratch. The journal is removed once the copy completes.
+ *
+ * With --verify every record also keeps a checksum of the source chunk.
+ * On rerun a finished chunk is skipped only if the destination
+ * still has the same checksum.
+ */
+#define CP_JOURNAL_CHUNK (64 << 20)
+#define CP_JOURNAL_MAGIC "MYCPJRN2"
+#define CP_JOURNAL_SUFFIX ".mycp-journal"
+
+struct journal_hdr {
+        char magic[8];
+        uint64_t size;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        uint64_t chunk;
+        uint64_t checksums;
+        uint64_t dst_dev;
+        uint64_t dst_ino;
+        uint64_t dst_size;
+};
+
+struct journal_rec {
+        uint64_t done;
+        uint64_t checksum;
+};
+
+struct journal {
+        int src_fd;
+        int dst_fd;
+        int fd;
+        int checksums;
+        off_t size;
+        size_t n_chunks;
+        atomic_size_t next;
+        atomic_size_t n_skipped;
+        atomic_int error;
+};
+
+/**
+ * Word-at-a-time multiplicative hash. Not cryptographic,
+ * it only has to notice chunks that were not written completely.
+ */
+int
+checksum_range(int fd, off_t off, off_t len, uint64_t *sum)
+{
+        assert(sum);
+
+        uint64_t *buf = malloc(CP_BUFSZ);
+        if (!buf)
+                return errno;
+
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (off_t end = off + len; off < end;) {
+                size_t n_want = (end - off < CP_BUFSZ) ? end - off : CP_BUFSZ;
+                ssize_t n_read = pread(fd, buf, n_want, off);
+                if (n_read == -1 && errno == EINTR)
+                        continue;
+                if (n_read <= 0)
+                        return free(buf), (n_read ? errno : EIO);
+
+                /* Zero-pad the tail to the whole word */
+                size_t n_words = (n_read + 7) / 8;
+                memset((char *)buf + n_read, 0, n_words * 8 - n_read);
+
+                for (size_t i = 0; i != n_words; i++)
+                        hash = (hash ^ buf[i]) * 0x100000001b3ull;
+
+                off += n_read;
+        }
+
+        free(buf);
+        *sum = hash;
+        return 0;
+}
+
+int
+journal_chunk(struct journal *jrn, size_t i)
+{
+        off_t off = (off_t)i * CP_JOURNAL_CHUNK;
+        off_t len = (jrn->size - off < CP_JOURNAL_CHUNK) ? jrn->size - off : CP_JOURNAL_CHUNK;
+        off_t rec_off = sizeof(struct journal_hdr) + i * sizeof(struct journal_rec);
+
+        struct journal_rec rec = {0};
+        if (pread(jrn->fd, &rec, sizeof(rec), rec_off) != sizeof(rec))
+                return errno ? errno : EIO;
+
+        if (rec.done && !opts.verify) {
+                atomic_fetch_add(&jrn->n_skipped, 1);
+                progress_add(len);
+                return 0;
+        }
+
+        uint64_t sum = 0;
+        if (rec.done && jrn->checksums && !checksum_range(jrn->dst_fd, off, len, &sum) &&
+            sum == rec.checksum) {
+                atomic_fetch_add(&jrn->n_skipped, 1);
+                progress_add(len);
+                return 0;
+        }
+
+        off_t transferred = 0;
+        int error = copy_sparse(jrn->src_fd, jrn->dst_fd, off, off + len, &transferred);
+        if (error)
+                return error;
+
+        rec.done = 1;
+        rec.checksum = 0;
+        if (jrn->checksums && (error = checksum_range(jrn->src_fd, off, len, &rec.checksum)))
+                return error;
+
+        if (fdatasync(jrn->dst_fd) == -1)
+                return errno;
+
+        if (pwrite(jrn->fd, &rec, sizeof(rec), rec_off) != sizeof(rec))
+                return errno ? errno : EIO;
+
+        return 0;
+}
+
+void *
+load_journal(void *args_p)
+{
+        struct journal *jrn = (struct journal *)args_p;
+
+        size_t i = 0;
+        while (!atomic_load(&jrn->error) && (i = atomic_fetch_add(&jrn->next, 1)) < jrn->n_chunks) {
+                int error = journal_chunk(jrn, i);
+                if (error)
+                        atomic_store(&jrn->error, error);
+        }
+
+        return NULL;
+}
+
+/**
+ * 'created' tells that dst_fd is a new file: whatever journal is
+ * lying around, it was not written for this destination.
+ */
 int
-copy(const char *src_nm, const char *dst_nm, int dir_fd, int forced)
+copy_journaled(int src_fd, int dst_fd, const struct stat *src_st,
+               int dst_dir, const char *dst_nm, int created)
+{
+        assert(src_st && dst_nm);
+
+        struct stat dst_st = {0};
+        if (fstat(dst_fd, &dst_st) == -1)
+                return errno;
+
+        char jrn_nm[PATH_MAX];
+        if (snprintf(jrn_nm, sizeof(jrn_nm), "%s" CP_JOURNAL_SUFFIX, dst_nm) >= (int)sizeof(jrn_nm))
+                return ENAMETOOLONG;
+
+        struct journal jrn = {
+                .src_fd = src_fd,
+                .dst_fd = dst_fd,
+                .size = src_st->st_size,
+                .n_chunks = (src_st->st_size + CP_JOURNAL_CHUNK - 1) / CP_JOURNAL_CHUNK,
+        };
+
+        jrn.fd = openat(dst_dir, jrn_nm, O_RDWR | O_CREAT, 0644);
+        if (jrn.fd == -1)
+                return errno;
+
+        struct journal_hdr hdr = {0};
+        int valid = !created &&
+                    pread(jrn.fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                    !memcmp(hdr.magic, CP_JOURNAL_MAGIC, sizeof(hdr.magic)) &&
+                    hdr.size == (uint64_t)src_st->st_size &&
+                    hdr.mtime_sec == src_st->st_mtim.tv_sec &&
+                    hdr.mtime_nsec == src_st->st_mtim.tv_nsec &&
+                    hdr.chunk == CP_JOURNAL_CHUNK &&
+                    hdr.dst_dev == (uint64_t)dst_st.st_dev &&
+                    hdr.dst_ino == (uint64_t)dst_st.st_ino &&
+                    hdr.dst_size == (uint64_t)dst_st.st_size;
+
+        int error = 0;
+        if (!valid) {
+                /* Start over: neither journal nor destination can be trusted */
+                hdr = (struct journal_hdr) {
+                        .size = src_st->st_size,
+                        .mtime_sec = src_st->st_mtim.tv_sec,
+                        .mtime_nsec = src_st->st_mtim.tv_nsec,
+                        .chunk = CP_JOURNAL_CHUNK,
+                        .checksums = opts.verify,
+                        .dst_dev = dst_st.st_dev,
+                        .dst_ino = dst_st.st_ino,
+                        /* What ftruncate() below leaves it with */
+                        .dst_size = src_st->st_size,
+                };
+                memcpy(hdr.magic, CP_JOURNAL_MAGIC, sizeof(hdr.magic));
+
+                off_t jrn_sz = sizeof(hdr) + jrn.n_chunks * sizeof(struct journal_rec);
+                if (ftruncate(jrn.fd, 0) == -1 || ftruncate(jrn.fd, jrn_sz) == -1 ||
+                    pwrite(jrn.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                    ftruncate(dst_fd, 0) == -1)
+                        error = errno;
+        }
+
+        jrn.checksums = hdr.checksums;
+        if (!error && ftruncate(dst_fd, src_st->st_size) == -1)
+                error = errno;
+
+        if (!error) {
+                atomic_init(&jrn.next, 0);
+                atomic_init(&jrn.n_skipped, 0);
+                atomic_init(&jrn.error, 0);
+
+                size_t n_workers = (size_t)opts.n_threads < jrn.n_chunks ? (size_t)opts.n_threads
+                                                                         : jrn.n_chunks;
+                pthread_t *tids = calloc(n_workers, sizeof(pthread_t));
+
+                size_t n_started = 0;
+                for (; tids && n_started != n_workers; n_started++)
+                        if (pthread_create(&tids[n_started], NULL, load_journal, &jrn))
+                                break;
+
+                /* Help the workers, or do everything if none started */
+                load_journal(&jrn);
+
+                for (size_t i = 0; i != n_started; i++)
+                        pthread_join(tids[i], NULL);
+
+                free(tids);
+                error = atomic_load(&jrn.error);
+        }
+
+        if (!error && opts.verbose)
+                fprintf(stderr, "%s: %zu of %zu chunks resumed from journal\n", dst_nm,
+                        atomic_load(&jrn.n_skipped), jrn.n_chunks);
+
+        if (!error && opts.fsync && fsync(dst_fd) == -1)
+                error = errno;
+
+        close(jrn.fd);
+        if (!error)
+                unlinkat(dst_dir, jrn_nm, 0);
+
+        return error;
+}
+
+/**
+ * Progress reporter thread: rate and ETA on stderr once a second.
+ */
+void
+progress_print(int last)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        const double mib = 1 << 20;
+        double elapsed = (now.tv_sec - progress.start.tv_sec) +
+                         (now.tv_nsec - progress.start.tv_nsec) / 1e9;
+        double done = atomic_load(&progress.done);
+        double rate = elapsed > 0 ? done / elapsed : 0;
+
+        fprintf(stderr, "\r%.1f", done / mib);
+        if (progress.total)
+                fprintf(stderr, " / %.1f MiB (%3.0f%%)", progress.total / mib,
+                        100.0 * done / progress.total);
+        else
+                fprintf(stderr, " MiB");
+
+        fprintf(stderr, "  %.1f MiB/s", rate / mib);
+        if (progress.total && rate > 0 && !last) {
+                long eta = (progress.total - done) / rate;
+                fprintf(stderr, "  ETA %02ld:%02ld:%02ld", eta / 3600, eta / 60 % 60, eta % 60);
+        }
+
+        fprintf(stderr, last ? "\n" : "\033[K");
+}
+
+void *
+load_progress(void *args_p)
+{
+        const struct timespec tick = {0, 100 * 1000 * 1000};
+
+        for (unsigned n_ticks = 1; !atomic_load(&progress.stop); n_ticks++) {
+                nanosleep(&tick, NULL);
+                if (n_ticks % 10 == 0)
+                        progress_print(0);
+        }
+
+        progress_print(1);
+        return NULL;
+}
+
+/**
+ * Copy regular file 'src_nm' relative to 'src_dir' into 'dst_nm' relative to 'dst_dir'.
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
+int
+copy_at(int src_dir, const char *src_nm, int dst_dir, const char *dst_nm)
 {
         assert(src_nm);
         assert(dst_nm);
 
-        int src_fd = open(src_nm, O_RDONLY);
+        int src_fd = openat(src_dir, src_nm, O_RDONLY);
         if (src_fd == -1)
-                return indicate_errno();
-
-        if (forced && unlinkat(dir_fd, dst_nm, 0) == -1)
-                return indicate_errno();
+                return errno;
 
+        int error = 0;
         struct stat src_st = {0};
-        int error = fstat(src_fd, &src_st);
-        if (error)
-                return indicate_errno();
+        if (fstat(src_fd, &src_st) == -1)
+                goto fail_src;
+
+        if (S_ISDIR(src_st.st_mode)) {
+                fprintf(stderr, "mycp: -r not specified; omitting directory '%s'\n", src_nm);
+                close(src_fd);
+                return EISDIR;
+        }
+
+        /* Small files are cheaper to copy again than to journal */
+        int resume = opts.resume && S_ISREG(src_st.st_mode) &&
+                     src_st.st_size > CP_JOURNAL_CHUNK;
 
-        int dst_fd = openat(dir_fd, dst_nm, O_TRUNC | O_CREAT | O_RDWR, src_st.st_mode);
+        if (!resume && opts.force && unlinkat(dst_dir, dst_nm, 0) == -1 && errno != ENOENT)
+                goto fail_src;
+
+        /* A resumed copy must know whether the destination is new */
+        int created = 0;
+        int dst_fd = -1;
+        if (resume) {
+                dst_fd = openat(dst_dir, dst_nm, O_RDWR);
+                if (dst_fd == -1 && errno == ENOENT) {
+                        dst_fd = openat(dst_dir, dst_nm, O_CREAT | O_EXCL | O_RDWR, src_st.st_mode);
+                        created = 1;
+                }
+        } else {
+                dst_fd = openat(dst_dir, dst_nm, O_TRUNC | O_CREAT | O_WRONLY, src_st.st_mode);
+        }
         if (dst_fd == -1)
-                return indicate_errno();
+                goto fail_src;
 
-        error = ftruncate(dst_fd, (src_st.st_size));
-        if (error == -1)
-                return indicate_errno();
+        if (resume)
+                error = copy_journaled(src_fd, dst_fd, &src_st, dst_dir, dst_nm, created);
+        else
+                error = copy_fd(src_fd, dst_fd, &src_st, src_nm);
+        if (!error && opts.preserve)
+                error = preserve(dst_fd, &src_st);
 
-        void *src = mmap(NULL, src_st.st_size, PROT_READ, MAP_PRIVATE, src_fd, 0);
-        if (src == MAP_FAILED)
-                return indicate_errno();
+        close(dst_fd);
+        close(src_fd);
+        return error;
+
+fail_src:
+        error = errno;
+        close(src_fd);
+        return error;
+}
 
-        void *dst = mmap(NULL, src_st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, dst_fd, 0);
-        if (dst == MAP_FAILED) {
-                munmap(src, src_st.st_size);
+int
+copy(const char *src_nm, const char *dst_nm, int dir_fd)
+{
+        int error = copy_at(AT_FDCWD, src_nm, dir_fd, dst_nm);
+        if (error && error != EISDIR) {
+                errno = error;
                 return indicate_errno();
         }
 
-        close(src_fd);
-        close(dst_fd);
+        return error;
+}
 
-        memcpy(dst, src, (size_t)src_st.st_size);
+/**
+ * Recursive copy.
+ *
+ * The calling thread walks the source tree with openat()/fdopendir(),
+ * creates destination directories and symlinks, and hands regular files
+ * to a pool of workers in batches of CP_BATCH names from one directory.
+ * Batching keeps queue locking off the per-file path for trees
+ * with millions of small files.
+ *
+ * Both directory fds are shared by the walker and all batches of
+ * the directory, so 'struct dir' is reference counted. The last release
+ * applies directory metadata: mtime has to be set after all writes.
+ */
+#define CP_BATCH 64
+#define CP_QUEUE 128
 
-        msync(dst, src_st.st_size, MS_SYNC);
+static mode_t umask_bits;
 
-        munmap(src, src_st.st_size);
-        munmap(dst, src_st.st_size);
+struct dir {
+        int src_fd;
+        int dst_fd;
+        struct stat st;
+        atomic_size_t refs;
+};
 
-        return 0;
+struct batch {
+        struct dir *dir;
+        size_t n_names;
+        char *names[CP_BATCH];
+};
+
+/**
+ * Bounded batch queue. The bound also limits
+ * the number of directory fds held open by pending batches.
+ */
+struct pool {
+        pthread_mutex_t mutex;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+
+        struct batch *queue[CP_QUEUE];
+        size_t head;
+        size_t tail;
+        size_t size;
+        int closed;
+
+        size_t n_workers;
+        pthread_t *tids;
+        atomic_int error;
+};
+
+/**
+ * Symlinks inside the tree are copied as links, 'follow' is set
+ * only for an operand named on the command line, as with cp -H.
+ */
+struct dir *
+dir_open(int src_parent, const char *src_nm, int dst_parent, const char *dst_nm, int follow)
+{
+        struct dir *dir = calloc(1, sizeof(struct dir));
+        if (!dir)
+                return NULL;
+
+        int flags = O_RDONLY | O_DIRECTORY | (follow ? 0 : O_NOFOLLOW);
+        dir->src_fd = openat(src_parent, src_nm, flags);
+        if (dir->src_fd == -1)
+                return free(dir), NULL;
+
+        if (fstat(dir->src_fd, &dir->st) == -1)
+                goto fail;
+
+        /* Owner must be able to fill the directory, final mode is set on release */
+        if (mkdirat(dst_parent, dst_nm, dir->st.st_mode | S_IRWXU) == -1 && errno != EEXIST)
+                goto fail;
+
+        dir->dst_fd = openat(dst_parent, dst_nm, O_RDONLY | O_DIRECTORY);
+        if (dir->dst_fd == -1)
+                goto fail;
+
+        atomic_init(&dir->refs, 1);
+        return dir;
+
+fail:
+        close(dir->src_fd);
+        free(dir);
+        return NULL;
+}
+
+void
+dir_release(struct pool *pool, struct dir *dir)
+{
+        if (atomic_fetch_sub(&dir->refs, 1) != 1)
+                return;
+
+        int error = 0;
+        if (opts.preserve)
+                error = preserve(dir->dst_fd, &dir->st);
+        else if ((dir->st.st_mode & S_IRWXU) != S_IRWXU)
+                error = fchmod(dir->dst_fd, dir->st.st_mode & ~umask_bits & 07777) ? errno : 0;
+
+        if (error) {
+                fprintf(stderr, "mycp: directory metadata: %s\n", strerror(error));
+                atomic_store(&pool->error, error);
+        }
+
+        close(dir->src_fd);
+        close(dir->dst_fd);
+        free(dir);
+}
+
+void
+batch_dtor(struct pool *pool, struct batch *batch)
+{
+        for (size_t i = 0; i != batch->n_names; i++)
+                free(batch->names[i]);
+
+        dir_release(pool, batch->dir);
+        free(batch);
+}
+
+void
+pool_put(struct pool *pool, struct batch *batch)
+{
+        pthread_mutex_lock(&pool->mutex);
+
+        while (pool->size == CP_QUEUE)
+                pthread_cond_wait(&pool->not_full, &pool->mutex);
+
+        pool->queue[pool->head] = batch;
+        pool->head = (pool->head + 1) % CP_QUEUE;
+        pool->size++;
+
+        pthread_cond_signal(&pool->not_empty);
+        pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Returns:
+ *      next batch, NULL once the pool is closed and drained.
+ */
+struct batch *
+pool_get(struct pool *pool)
+{
+        pthread_mutex_lock(&pool->mutex);
+
+        while (pool->size == 0 && !pool->closed)
+                pthread_cond_wait(&pool->not_empty, &pool->mutex);
+
+        struct batch *batch = NULL;
+        if (pool->size) {
+                batch = pool->queue[pool->tail];
+                pool->tail = (pool->tail + 1) % CP_QUEUE;
+                pool->size--;
+                pthread_cond_signal(&pool->not_full);
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+        return batch;
+}
+
+void *
+load_worker(void *args_p)
+{
+        struct pool *pool = (struct pool *)args_p;
+
+        struct batch *batch = NULL;
+        while ((batch = pool_get(pool))) {
+                for (size_t i = 0; i != batch->n_names; i++) {
+                        const char *name = batch->names[i];
+                        int error = copy_at(batch->dir->src_fd, name, batch->dir->dst_fd, name);
+                        if (error) {
+                                fprintf(stderr, "mycp: %s: %s\n", name, strerror(error));
+                                atomic_store(&pool->error, error);
+                        }
+                }
+
+                batch_dtor(pool, batch);
+        }
+
+        return NULL;
 }
 
 int
-main(int argc, char *argv[])
+pool_ctor(struct pool *pool, size_t n_workers)
 {
-        struct {
-                int interactive;
-                int force;
-                int verbose;
-        } opts = {0, 0, 0};
+        assert(pool && n_workers);
 
-        /**
-         * Redirect long options straight to the short options handlers
-         * Note: the last element has to be filled with zeroes.
-         */
-        static struct option options[] = {
-            {"verbose",     no_argument, NULL, 'v'},
-            {"force",       no_argument, NULL, 'f'},
-            {"interactive", no_argument, NULL, 'i'},
-            { 0,            0,           0,     0 },
-        };
+        memset(pool, 0, sizeof(*pool));
+        pthread_mutex_init(&pool->mutex, NULL);
+        pthread_cond_init(&pool->not_empty, NULL);
+        pthread_cond_init(&pool->not_full, NULL);
+        atomic_init(&pool->error, 0);
 
-        int opt = 0;
-        while ((opt = getopt_long(argc, argv, "vfi", options, NULL)) != -1) {
+        pool->tids = calloc(n_workers, sizeof(pthread_t));
+        if (!pool->tids)
+                return errno;
 
-                switch(opt) {
-                case 'v':
-                        opts.verbose = 1;
+        for (; pool->n_workers != n_workers; pool->n_workers++)
+                if (pthread_create(&pool->tids[pool->n_workers], NULL, load_worker, pool))
                         break;
-                case 'i':
-                        opts.interactive = 1;
+
+        return pool->n_workers ? 0 : EAGAIN;
+}
+
+void
+pool_dtor(struct pool *pool)
+{
+        pthread_mutex_lock(&pool->mutex);
+        pool->closed = 1;
+        pthread_cond_broadcast(&pool->not_empty);
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (size_t i = 0; i != pool->n_workers; i++)
+                pthread_join(pool->tids[i], NULL);
+
+        free(pool->tids);
+        pthread_cond_destroy(&pool->not_empty);
+        pthread_cond_destroy(&pool->not_full);
+        pthread_mutex_destroy(&pool->mutex);
+}
+
+int
+copy_link(struct dir *dir, const char *name)
+{
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(dir->src_fd, name, target, sizeof(target) - 1);
+        if (len == -1)
+                return errno;
+
+        target[len] = '\0';
+
+        if (opts.force && unlinkat(dir->dst_fd, name, 0) == -1 && errno != ENOENT)
+                return errno;
+
+        if (symlinkat(target, dir->dst_fd, name) == -1)
+                return errno;
+
+        if (!opts.preserve)
+                return 0;
+
+        struct stat st = {0};
+        if (fstatat(dir->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                return errno;
+
+        const struct timespec times[2] = {st.st_atim, st.st_mtim};
+        if (fchownat(dir->dst_fd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) == -1 && errno != EPERM)
+                return errno;
+        if (utimensat(dir->dst_fd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+                return errno;
+
+        return 0;
+}
+
+void
+walk(struct pool *pool, struct dir *dir)
+{
+        assert(pool && dir);
+
+        /* fdopendir() owns its fd, keep ours for openat() */
+        int fd = dup(dir->src_fd);
+        DIR *stream = fd == -1 ? NULL : fdopendir(fd);
+        if (!stream) {
+                fprintf(stderr, "mycp: opendir: %s\n", strerror(errno));
+                atomic_store(&pool->error, errno);
+                if (fd != -1)
+                        close(fd);
+                return;
+        }
+
+        struct batch *batch = NULL;
+        const struct dirent *ent = NULL;
+        while ((ent = readdir(stream))) {
+                const char *name = ent->d_name;
+                if (!strcmp(name, ".") || !strcmp(name, ".."))
+                        continue;
+
+                /* d_type lets us skip stat for the common case */
+                unsigned char type = ent->d_type;
+                struct stat st;
+                if (type == DT_UNKNOWN && fstatat(dir->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                        type = IFTODT(st.st_mode);
+
+                int error = 0;
+                switch (type) {
+                case DT_REG:
+                        if (!batch && !(batch = calloc(1, sizeof(struct batch)))) {
+                                error = errno;
+                                break;
+                        }
+
+                        if (!batch->dir) {
+                                atomic_fetch_add(&dir->refs, 1);
+                                batch->dir = dir;
+                        }
+
+                        if (!(batch->names[batch->n_names] = strdup(name))) {
+                                error = errno;
+                                break;
+                        }
+
+                        if (++batch->n_names == CP_BATCH) {
+                                pool_put(pool, batch);
+                                batch = NULL;
+                        }
                         break;
-                case 'f':
-                        opts.force = 1;
+                case DT_DIR: {
+                        struct dir *sub = dir_open(dir->src_fd, name, dir->dst_fd, name, 0);
+                        if (!sub) {
+                                error = errno;
+                                break;
+                        }
+
+                        walk(pool, sub);
+                        dir_release(pool, sub);
+                        break;
+                }
+                case DT_LNK:
+                        error = copy_link(dir, name);
                         break;
                 default:
-                        assert(0 && "getopt_long failed what?");
+                        fprintf(stderr, "mycp: %s: skipping special file\n", name);
                         break;
                 }
+
+                if (error) {
+                        fprintf(stderr, "mycp: %s: %s\n", name, strerror(error));
+                        atomic_store(&pool->error, error);
+                }
         }
 
-        /**
-         * Eventually all nonoptions (file names in our case), are at the end.
-         * Now we need at least source and destination file specified.
-         */
-        if (argc - optind < 2) {
-                fprintf(stderr, "missing destination file operand after '%s'\n", argv[optind]);
-                return 0xdead;
+        if (batch)
+                pool_put(pool, batch);
+
+        closedir(stream);
+}
+
+int
+copy_tree(const char *src_nm, const char *dst_nm, int dir_fd)
+{
+        assert(src_nm);
+        assert(dst_nm);
+
+        struct pool pool;
+        int error = pool_ctor(&pool, opts.n_threads);
+        if (error) {
+                pool_dtor(&pool);
+                errno = error;
+                return indicate_errno();
+        }
+
+        struct dir *root = dir_open(AT_FDCWD, src_nm, dir_fd, dst_nm, 1);
+        if (!root) {
+                error = indicate_errno();
+                pool_dtor(&pool);
+                return error;
         }
 
+        walk(&pool, root);
+        dir_release(&pool, root);
+
+        pool_dtor(&pool);
+        return atomic_load(&pool.error);
+}
+
+/**
+ * Dispatch single operand: trees need -r, everything else is a file copy.
+ */
+int
+copy_any(const char *src_nm, const char *dst_nm, int dir_fd)
+{
+        struct stat src_st = {0};
+        if (opts.recursive && stat(src_nm, &src_st) == 0 && S_ISDIR(src_st.st_mode))
+                return copy_tree(src_nm, dst_nm, dir_fd);
+
+        return copy(src_nm, dst_nm, dir_fd);
+}
+
+/**
+ * Copy all operands: either several sources into a directory
+ * or a single source to a destination name.
+ * Returns:
+ *      0 on success, the first error otherwise. A failed operand
+ *      does not stop the remaining ones.
+ */
+int
+copy_operands(int argc, char *argv[])
+{
         struct stat dst_st = {0};
         if (stat(argv[argc - 1], &dst_st) == 0 && S_ISDIR(dst_st.st_mode)) {
 
@@ -134,6 +1128,7 @@ main(int argc, char *argv[])
                 if (dir == -1)
                         return indicate_errno();
 
+                int error = 0;
                 for (int i = optind; i < argc; i++) {
 
                         const char *dst = basename(argv[i]);
@@ -146,10 +1141,13 @@ main(int argc, char *argv[])
                         if (opts.verbose)
                                 fprintf(stderr, "Moved %s --> %s/%s\n", argv[i], dir_name, dst);
 
-                        copy(argv[i], basename(argv[i]), dir, opts.force);
+                        int op_error = copy_any(argv[i], dst, dir);
+                        if (!error)
+                                error = op_error;
                 }
 
-                return 0;
+                close(dir);
+                return error;
         }
 
         if (argc - optind != 2) {
@@ -167,7 +1165,123 @@ main(int argc, char *argv[])
         if (opts.verbose)
                 fprintf(stderr, "Moved %s --> %s\n", argv[optind], dst);
 
-        return copy(argv[optind], dst, AT_FDCWD, opts.force);
+        return copy_any(argv[optind], dst, AT_FDCWD);
+}
+
+/**
+ * Total is known only when every source is a regular file.
+ */
+void
+progress_start(int argc, char *argv[], pthread_t *tid)
+{
+        struct stat st = {0};
+        for (int i = optind; i < argc - 1; i++) {
+                if (stat(argv[i], &st) == -1 || !S_ISREG(st.st_mode)) {
+                        progress.total = 0;
+                        break;
+                }
+
+                progress.total += st.st_size;
+        }
+
+        atomic_init(&progress.done, 0);
+        atomic_init(&progress.stop, 0);
+        clock_gettime(CLOCK_MONOTONIC, &progress.start);
+
+        if (pthread_create(tid, NULL, load_progress, NULL))
+                opts.progress = 0;
 }
 
+int
+main(int argc, char *argv[])
+{
+        opts.n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        /**
+         * Redirect long options straight to the short options handlers
+         * Note: the last element has to be filled with zeroes.
+         */
+        static struct option options[] = {
+            {"verbose",     no_argument, NULL, 'v'},
+            {"force",       no_argument, NULL, 'f'},
+            {"interactive", no_argument, NULL, 'i'},
+            {"fsync",       no_argument, NULL, 'S'},
+            {"recursive",   no_argument, NULL, 'r'},
+            {"preserve",    no_argument, NULL, 'p'},
+            {"progress",    no_argument, NULL, 'g'},
+            {"resume",      no_argument, NULL, 'c'},
+            {"verify",      no_argument, NULL, 'V'},
+            {"jobs",  required_argument, NULL, 'j'},
+            { 0,            0,           0,     0 },
+        };
+
+        int opt = 0;
+        while ((opt = getopt_long(argc, argv, "vfiSrRpgcVj:", options, NULL)) != -1) {
 
+                switch(opt) {
+                case 'v':
+                        opts.verbose = 1;
+                        break;
+                case 'i':
+                        opts.interactive = 1;
+                        break;
+                case 'f':
+                        opts.force = 1;
+                        break;
+                case 'S':
+                        opts.fsync = 1;
+                        break;
+                case 'r':
+                case 'R':
+                        opts.recursive = 1;
+                        break;
+                case 'p':
+                        opts.preserve = 1;
+                        break;
+                case 'g':
+                        opts.progress = 1;
+                        break;
+                case 'c':
+                        opts.resume = 1;
+                        break;
+                case 'V':
+                        opts.resume = 1;
+                        opts.verify = 1;
+                        break;
+                case 'j':
+                        opts.n_threads = atol(optarg);
+                        break;
+                default:
+                        assert(0 && "getopt_long failed what?");
+                        break;
+                }
+        }
+
+        if (opts.n_threads < 1)
+                opts.n_threads = 1;
+
+        umask_bits = umask(0);
+        umask(umask_bits);
+
+        /**
+         * Eventually all nonoptions (file names in our case), are at the end.
+         * Now we need at least source and destination file specified.
+         */
+        if (argc - optind < 2) {
+                fprintf(stderr, "missing destination file operand after '%s'\n", argv[optind]);
+                return 0xdead;
+        }
+
+        pthread_t progress_tid;
+        if (opts.progress)
+                progress_start(argc, argv, &progress_tid);
+
+        int error = copy_operands(argc, argv);
+
+        if (opts.progress) {
+                atomic_store(&progress.stop, 1);
+                pthread_join(progress_tid, NULL);
+        }
+
+        return error;
+}
@@ -2,9 +2,17 @@
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 typedef struct {
         int newline;
+        int escapes;
 } setup_t;
 
 setup_t
@@ -13,11 +21,17 @@ configure(int argc, char *argv[])
         setup_t setup = {0};
 
         int opt = 0;
-        while ((opt = getopt(argc, argv, "n")) != -1) {
+        while ((opt = getopt(argc, argv, "neE")) != -1) {
                 switch (opt) {
                 case 'n':
                         setup.newline = 1;
                         break;
+                case 'e':
+                        setup.escapes = 1;
+                        break;
+                case 'E':
+                        setup.escapes = 0;
+                        break;
                 default:
                         return setup;
                 }
@@ -26,30 +40,172 @@ configure(int argc, char *argv[])
         return setup;
 }
 
+/**
+ * Decodes -e escapes in place, in a single pass: the result is
+ * never longer than the source, so it is written over it.
+ * Returns:
+ *      length of the decoded string. '*stop' is set on '\c',
+ *      which ends all output right there.
+ */
+size_t
+unescape(char *str, int *stop)
+{
+        assert(str && stop);
+
+        char *src = strchr(str, '\\');
+        if (!src)
+                return strlen(str);
+
+        char *dst = src;
+        while (*src) {
+                if (*src != '\\' || !src[1]) {
+                        *dst++ = *src++;
+                        continue;
+                }
+
+                src++;
+                switch (*src++) {
+                case '\\': *dst++ = '\\';   break;
+                case 'a':  *dst++ = '\a';   break;
+                case 'b':  *dst++ = '\b';   break;
+                case 'e':  *dst++ = '\033'; break;
+                case 'f':  *dst++ = '\f';   break;
+                case 'n':  *dst++ = '\n';   break;
+                case 'r':  *dst++ = '\r';   break;
+                case 't':  *dst++ = '\t';   break;
+                case 'v':  *dst++ = '\v';   break;
+                case 'c':
+                        *stop = 1;
+                        return dst - str;
+                case '0': {
+                        /* \0nnn: up to three octal digits */
+                        unsigned char byte = 0;
+                        for (int i = 0; i != 3 && *src >= '0' && *src <= '7'; i++)
+                                byte = byte * 8 + (*src++ - '0');
+                        *dst++ = byte;
+                        break;
+                }
+                case '1': case '2': case '3':
+                case '4': case '5': case '6': case '7': {
+                        /* \nnn: one to three octal digits, without the 0 */
+                        unsigned char byte = src[-1] - '0';
+                        for (int i = 1; i != 3 && *src >= '0' && *src <= '7'; i++)
+                                byte = byte * 8 + (*src++ - '0');
+                        *dst++ = byte;
+                        break;
+                }
+                case 'x': {
+                        /* \xHH: up to two hex digits, or a literal "\x" */
+                        unsigned char byte = 0;
+                        int i = 0;
+                        for (; i != 2; i++, src++) {
+                                char c = *src;
+                                if (c >= '0' && c <= '9')
+                                        byte = byte * 16 + (c - '0');
+                                else if (c >= 'a' && c <= 'f')
+                                        byte = byte * 16 + (c - 'a' + 10);
+                                else if (c >= 'A' && c <= 'F')
+                                        byte = byte * 16 + (c - 'A' + 10);
+                                else
+                                        break;
+                        }
+
+                        if (i) {
+                                *dst++ = byte;
+                        } else {
+                                *dst++ = '\\';
+                                *dst++ = 'x';
+                        }
+                        break;
+                }
+                default:
+                        /* Unknown escapes are printed as is */
+                        *dst++ = '\\';
+                        *dst++ = src[-1];
+                        break;
+                }
+        }
+
+        return dst - str;
+}
+
+/**
+ * writev() may write less than asked: skip what is done and retry.
+ * Returns:
+ *      0 on success, -1 on error.
+ */
+int
+write_iov(struct iovec *iov, int n_iov)
+{
+        while (n_iov) {
+                ssize_t n_written = writev(STDOUT_FILENO, iov, n_iov);
+                if (n_written == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                while (n_iov && (size_t)n_written >= iov->iov_len) {
+                        n_written -= iov->iov_len;
+                        iov++;
+                        n_iov--;
+                }
+
+                if (n_iov) {
+                        iov->iov_base = (char *)iov->iov_base + n_written;
+                        iov->iov_len -= n_written;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Output is an iovec array over the argv strings themselves with
+ * separators in between: nothing is copied, and it leaves in one
+ * writev() per IOV_MAX pieces however many arguments there are.
+ */
 int
 main(int argc, char *argv[])
 {
-        int error = 0;
+        static char space[] = " ";
+        static char newline[] = "\n";
+
         setup_t setup = configure(argc, argv);
-        
-        int arg = optind;
-        while (arg < argc) {
 
-                error = printf("%s", argv[arg]);
-                if (error < 0)
-                        return error;
+        struct iovec iov[IOV_MAX];
+        int n_iov = 0;
+        int stop = 0;
+
+        for (int arg = optind; arg < argc && !stop; arg++) {
+                size_t len = setup.escapes ? unescape(argv[arg], &stop) : strlen(argv[arg]);
+
+                /* Room for the argument and its separator */
+                if (n_iov + 2 > IOV_MAX) {
+                        if (write_iov(iov, n_iov))
+                                return -1;
+                        n_iov = 0;
+                }
+
+                if (len)
+                        iov[n_iov++] = (struct iovec){argv[arg], len};
+
+                if (arg != argc - 1 && !stop)
+                        iov[n_iov++] = (struct iovec){space, 1};
+        }
 
-                if (arg != argc - 1) {
-                        error = printf(" ");
-                        if (error < 0)
-                                return error;
+        if (!setup.newline && !stop) {
+                if (n_iov == IOV_MAX) {
+                        if (write_iov(iov, n_iov))
+                                return -1;
+                        n_iov = 0;
                 }
 
-                arg++;
+                iov[n_iov++] = (struct iovec){newline, 1};
         }
 
-        if (!setup.newline)
-                printf("\n");
+        if (write_iov(iov, n_iov))
+                return -1;
 
         return 0;
 }
@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 void print_group(gid_t gid)
@@ -26,9 +32,480 @@ void print_user(uid_t uid)
         printf(" ");
 }
 
+/**
+ * Batch mode: thousands of users per run.
+ *
+ * getgrgid/getgrouplist per user re-read the group database every
+ * time. Instead passwd and group are enumerated once (getpwent and
+ * getgrent, so NSS is still respected) into two hash indexes:
+ * users by name with their supplementary groups attached, and
+ * group names by gid. After that every user resolves from memory,
+ * so the batch is split between threads with no locking at all.
+ */
+struct user {
+        const char *name;
+        uid_t uid;
+        gid_t gid;
+
+        gid_t *groups;
+        size_t n_groups;
+        size_t capacity;
+};
+
+struct group_name {
+        gid_t gid;
+        const char *name;
+};
+
+struct index {
+        struct user *users;
+        size_t users_capacity;
+
+        struct group_name *groups;
+        size_t groups_capacity;
+};
+
+static size_t
+hash_name(const char *name)
+{
+        /* FNV-1a */
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (; *name; name++)
+                hash = (hash ^ (unsigned char)*name) * 0x100000001b3ull;
+        return hash;
+}
+
+static size_t
+hash_gid(gid_t gid)
+{
+        return (size_t)((gid * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/* Capacity for n entries with load factor below 1/2 */
+static size_t
+table_capacity(size_t n)
+{
+        size_t capacity = 0x40;
+        while (capacity < 2 * n)
+                capacity <<= 1;
+        return capacity;
+}
+
+static struct user *
+find_user(const struct index *index, const char *name)
+{
+        size_t mask = index->users_capacity - 1;
+        for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+                struct user *user = &index->users[i];
+                if (!user->name || !strcmp(user->name, name))
+                        return user;
+        }
+}
+
+static struct group_name *
+find_group(const struct index *index, gid_t gid)
+{
+        size_t mask = index->groups_capacity - 1;
+        for (size_t i = hash_gid(gid) & mask;; i = (i + 1) & mask) {
+                struct group_name *group = &index->groups[i];
+                if (!group->name || group->gid == gid)
+                        return group;
+        }
+}
+
+static int
+user_add_group(struct user *user, gid_t gid)
+{
+        /* Primary group comes first and only once, like getgrouplist */
+        for (size_t i = 0; i != user->n_groups; i++)
+                if (user->groups[i] == gid)
+                        return 0;
+
+        if (user->n_groups == user->capacity) {
+                size_t capacity = user->capacity ? user->capacity << 1 : 4;
+                gid_t *groups = realloc(user->groups, capacity * sizeof(gid_t));
+                if (!groups)
+                        return errno;
+
+                user->groups = groups;
+                user->capacity = capacity;
+        }
+
+        user->groups[user->n_groups++] = gid;
+        return 0;
+}
+
+/**
+ * Tables are sized by a first count of entries, the second pass
+ * fills them. Both passes are plain sequential file reads.
+ * On failure the index is left safe to pass to index_dtor().
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
 int
-main(int argc, const char *argv[])
+index_ctor(struct index *index)
 {
+        memset(index, 0, sizeof(*index));
+
+        size_t n_users = 0;
+        setpwent();
+        while (getpwent())
+                n_users++;
+
+        index->users_capacity = table_capacity(n_users);
+        index->users = calloc(index->users_capacity, sizeof(struct user));
+        if (!index->users)
+                return index->users_capacity = 0, errno;
+
+        setpwent();
+        for (struct passwd *pwd = NULL; (pwd = getpwent());) {
+                struct user *user = find_user(index, pwd->pw_name);
+                if (user->name)
+                        continue; /* First entry wins, like getpwnam */
+
+                user->name = strdup(pwd->pw_name);
+                if (!user->name)
+                        return errno;
+
+                user->uid = pwd->pw_uid;
+                user->gid = pwd->pw_gid;
+                if (user_add_group(user, pwd->pw_gid))
+                        return errno;
+        }
+        endpwent();
+
+        size_t n_groups = 0;
+        setgrent();
+        while (getgrent())
+                n_groups++;
+
+        index->groups_capacity = table_capacity(n_groups);
+        index->groups = calloc(index->groups_capacity, sizeof(struct group_name));
+        if (!index->groups)
+                return index->groups_capacity = 0, errno;
+
+        setgrent();
+        for (struct group *grp = NULL; (grp = getgrent());) {
+                struct group_name *group = find_group(index, grp->gr_gid);
+                if (!group->name) {
+                        group->gid = grp->gr_gid;
+                        group->name = strdup(grp->gr_name);
+                        if (!group->name)
+                                return errno;
+                }
+
+                for (char **member = grp->gr_mem; *member; member++) {
+                        struct user *user = find_user(index, *member);
+                        if (user->name && user_add_group(user, grp->gr_gid))
+                                return errno;
+                }
+        }
+        endgrent();
+
+        return 0;
+}
+
+void
+index_dtor(struct index *index)
+{
+        for (size_t i = 0; i != index->users_capacity; i++) {
+                free((char *)index->users[i].name);
+                free(index->users[i].groups);
+        }
+
+        for (size_t i = 0; i != index->groups_capacity; i++)
+                free((char *)index->groups[i].name);
+
+        free(index->users);
+        free(index->groups);
+}
+
+/**
+ * Output of one thread, written out in order at the end.
+ */
+struct out {
+        char *data;
+        size_t size;
+        size_t capacity;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void
+out_printf(struct out *out, const char *fmt, ...)
+{
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(out->data + out->size, out->capacity - out->size, fmt, args);
+        va_end(args);
+
+        if (len < 0)
+                return;
+
+        if ((size_t)len >= out->capacity - out->size) {
+                size_t capacity = out->capacity ? out->capacity : 0x1000;
+                while (capacity - out->size <= (size_t)len)
+                        capacity <<= 1;
+
+                char *data = realloc(out->data, capacity);
+                if (!data)
+                        return;
+
+                out->data = data;
+                out->capacity = capacity;
+
+                va_start(args, fmt);
+                vsnprintf(out->data + out->size, out->capacity - out->size, fmt, args);
+                va_end(args);
+        }
+
+        out->size += len;
+}
+
+static void
+out_id(struct out *out, const char *prefix, unsigned id, const char *name)
+{
+        out_printf(out, "%s%d", prefix, id);
+        if (name)
+                out_printf(out, "(%s)", name);
+        out_printf(out, " ");
+}
+
+static const char *
+group_name(const struct index *index, gid_t gid)
+{
+        return find_group(index, gid)->name;
+}
+
+/**
+ * Users missing from the enumeration (NSS backends may refuse
+ * to enumerate) are looked up one by one, with reentrant calls.
+ * Returns:
+ *      0 on success, errno or ENOENT if there is no such user.
+ */
+static int
+resolve_slow(struct out *out, const struct index *index, const char *name)
+{
+        struct passwd pwd;
+        struct passwd *result = NULL;
+        char buf[0x1000];
+
+        int error = getpwnam_r(name, &pwd, buf, sizeof(buf), &result);
+        if (!result)
+                return error ? error : ENOENT;
+
+        int n_groups = sysconf(_SC_NGROUPS_MAX) + 1;
+        gid_t *groups = calloc(n_groups, sizeof(gid_t));
+        if (!groups)
+                return errno;
+
+        if (getgrouplist(pwd.pw_name, pwd.pw_gid, groups, &n_groups) == -1) {
+                free(groups);
+                return ERANGE;
+        }
+
+        out_id(out, "uid=", pwd.pw_uid, pwd.pw_name);
+        out_id(out, "gid=", pwd.pw_gid, group_name(index, pwd.pw_gid));
+        out_printf(out, "groups=");
+        for (int i = 0; i < n_groups; i++)
+                out_id(out, "", groups[i], group_name(index, groups[i]));
+        out_printf(out, "\n");
+
+        free(groups);
+        return 0;
+}
+
+struct batch {
+        const struct index *index;
+        char **names;
+        size_t n_names;
+
+        struct out out;
+        struct out err;
+};
+
+void *
+resolve_batch(void *batch_p)
+{
+        struct batch *batch = (struct batch *)batch_p;
+        const struct index *index = batch->index;
+
+        for (size_t i = 0; i != batch->n_names; i++) {
+                const char *name = batch->names[i];
+                const struct user *user = find_user(index, name);
+                if (!user->name) {
+                        int error = resolve_slow(&batch->out, index, name);
+                        if (error)
+                                out_printf(&batch->err, "myid: %s: %s\n", name,
+                                           error == ENOENT ? "no such user" : strerror(error));
+                        continue;
+                }
+
+                out_id(&batch->out, "uid=", user->uid, user->name);
+                out_id(&batch->out, "gid=", user->gid, group_name(index, user->gid));
+                out_printf(&batch->out, "groups=");
+                for (size_t k = 0; k != user->n_groups; k++)
+                        out_id(&batch->out, "", user->groups[k], group_name(index, user->groups[k]));
+                out_printf(&batch->out, "\n");
+        }
+
+        return NULL;
+}
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+        while (size) {
+                ssize_t n_written = write(fd, data, size);
+                if (n_written == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return errno;
+                }
+
+                data += n_written;
+                size -= n_written;
+        }
+
+        return 0;
+}
+
+/**
+ * Reads names one per line.
+ * Returns:
+ *      array of names, NULL on failure.
+ */
+char **
+read_names(FILE *file, size_t *n_names)
+{
+        char **names = NULL;
+        size_t capacity = 0;
+        *n_names = 0;
+
+        char *line = NULL;
+        size_t line_sz = 0;
+        ssize_t len = 0;
+        while ((len = getline(&line, &line_sz, file)) != -1) {
+                if (len && line[len - 1] == '\n')
+                        line[--len] = '\0';
+                if (!len)
+                        continue;
+
+                if (*n_names == capacity) {
+                        capacity = capacity ? capacity << 1 : 0x100;
+                        char **grown = realloc(names, capacity * sizeof(char *));
+                        if (!grown)
+                                break;
+                        names = grown;
+                }
+
+                names[*n_names] = strdup(line);
+                if (!names[*n_names])
+                        break;
+                (*n_names)++;
+        }
+
+        free(line);
+        return names ? names : calloc(1, sizeof(char *));
+}
+
+/* Fewer names per thread are not worth starting it */
+#define BATCH_MIN 0x40
+
+int
+batch(char **names, size_t n_names, long n_threads)
+{
+        struct index index;
+        int error = index_ctor(&index);
+        if (error) {
+                fprintf(stderr, "myid: %s\n", strerror(error));
+                index_dtor(&index);
+                return error;
+        }
+
+        if (n_threads < 1)
+                n_threads = 1;
+        if ((size_t)n_threads > n_names / BATCH_MIN)
+                n_threads = n_names / BATCH_MIN ? n_names / BATCH_MIN : 1;
+
+        struct batch *batches = calloc(n_threads, sizeof(struct batch));
+        pthread_t *tids = calloc(n_threads, sizeof(pthread_t));
+        if (!batches || !tids) {
+                free(batches);
+                index_dtor(&index);
+                return errno;
+        }
+
+        size_t per_thread = (n_names + n_threads - 1) / n_threads;
+        for (long i = 0; i != n_threads; i++) {
+                size_t first = i * per_thread < n_names ? i * per_thread : n_names;
+                size_t last = first + per_thread < n_names ? first + per_thread : n_names;
+
+                batches[i].index = &index;
+                batches[i].names = names + first;
+                batches[i].n_names = last - first;
+
+                /* The last batch is ours, and so is everything if a thread fails */
+                if (i == n_threads - 1 || pthread_create(&tids[i], NULL, resolve_batch, &batches[i]))
+                        tids[i] = 0, resolve_batch(&batches[i]);
+        }
+
+        int status = 0;
+        for (long i = 0; i != n_threads; i++) {
+                if (tids[i])
+                        pthread_join(tids[i], NULL);
+
+                write_all(STDERR_FILENO, batches[i].err.data, batches[i].err.size);
+                write_all(STDOUT_FILENO, batches[i].out.data, batches[i].out.size);
+                if (batches[i].err.size)
+                        status = 1;
+
+                free(batches[i].out.data);
+                free(batches[i].err.data);
+        }
+
+        free(batches);
+        free(tids);
+        index_dtor(&index);
+        return status;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int is_batch = 0;
+        long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        int opt = 0;
+        while ((opt = getopt(argc, argv, "bj:")) != -1) {
+                switch (opt) {
+                case 'b':
+                        is_batch = 1;
+                        break;
+                case 'j':
+                        n_threads = atol(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "Incorrect input\n");
+                        return 0;
+                }
+        }
+
+        argv += optind - 1;
+        argc -= optind - 1;
+
+        /* Several users, or names from stdin with -b */
+        if (is_batch || argc > 2) {
+                size_t n_names = argc - 1;
+                char **names = argv + 1;
+                if (!n_names) {
+                        names = read_names(stdin, &n_names);
+                        if (!names)
+                                return errno;
+                }
+
+                return batch(names, n_names, n_threads);
+        }
+
         int is_context = 1;
 
         errno = 0;
@@ -1,11 +1,14 @@
+#define _GNU_SOURCE
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 #include <string.h>
+#include <locale.h>
 #include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -13,8 +16,14 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <dirent.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <linux/limits.h>
+#include <linux/io_uring.h>
 
 /**
  * I have no idea why to use bitfields here :)
@@ -28,254 +37,1992 @@ struct {
         unsigned inode : 1;
         unsigned numeric_uid_gid : 1;
         unsigned name_dir: 1;
+        unsigned uring : 1;
+        unsigned preload : 1;
+        unsigned sort : 3;
+        unsigned reverse : 1;
+        unsigned summarize : 1;
 } opts = {0};
 
+/* Order of entries in a block, SORT_NONE keeps 'getdents' order */
+enum sort {
+        SORT_NAME = 0,
+        SORT_NONE,
+        SORT_TIME,
+        SORT_SIZE,
+        SORT_VERSION,
+};
+
+/* Long-only options get values out of the char range */
+enum {
+        OPT_URING = 0x100,
+        OPT_PRELOAD,
+        OPT_SUMMARIZE,
+};
+
+/**
+ * Growing output buffer. Every directory block is formatted
+ * into its own buffer, so blocks can be built concurrently
+ * and written out in order.
+ */
+struct buf {
+        char *data;
+        size_t size;
+        size_t capacity;
+};
+
+int
+buf_reserve(struct buf *buf, size_t n_bytes)
+{
+        assert(buf);
+
+        if (buf->capacity - buf->size >= n_bytes)
+                return 0;
+
+        size_t capacity = buf->capacity ? buf->capacity : 0x1000;
+        while (capacity - buf->size < n_bytes)
+                capacity <<= 1;
+
+        char *data = realloc(buf->data, capacity);
+        if (!data)
+                return errno;
+
+        buf->data = data;
+        buf->capacity = capacity;
+        return 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+int
+buf_printf(struct buf *buf, const char *fmt, ...)
+{
+        assert(buf && fmt);
+
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(NULL, 0, fmt, args);
+        va_end(args);
+
+        if (len < 0 || buf_reserve(buf, len + 1))
+                return -1;
+
+        va_start(args, fmt);
+        vsnprintf(buf->data + buf->size, len + 1, fmt, args);
+        va_end(args);
+
+        buf->size += len;
+        return len;
+}
+
+void
+buf_dtor(struct buf *buf)
+{
+        free(buf->data);
+        buf->data = NULL;
+        buf->size = buf->capacity = 0;
+}
+
+/**
+ * strftime() with localtime_r() is the most expensive part of a row.
+ * The format has no seconds, so a whole directory written within
+ * the same minute formats the date only once. Cache is per thread:
+ * workers format their blocks concurrently.
+ */
+struct date_cache {
+        time_t minute;
+        int valid;
+        size_t len;
+        char str[0x40];
+};
+
+static __thread struct date_cache date_cache;
+
+size_t
+put_time(char *p, time_t time)
+{
+        /* Floor division: times before the epoch are negative */
+        time_t minute = time / 60 - (time % 60 < 0);
+
+        struct date_cache *cache = &date_cache;
+        if (!cache->valid || cache->minute != minute) {
+                struct tm tm;
+                const char *fmt = "%b %d %Y %H:%M";
+                cache->len = strftime(cache->str, sizeof(cache->str), fmt,
+                                      localtime_r(&time, &tm));
+                cache->minute = minute;
+                cache->valid = 1;
+        }
+
+        memcpy(p, cache->str, cache->len);
+        return cache->len;
+}
+
+size_t
+put_mode(char *p, mode_t mode)
+{
+        /* Simple but effective and clean... */
+        char *bit = p;
+        switch (mode & S_IFMT) {
+        case S_IFDIR:  *bit++ = 'd'; break;
+        case S_IFLNK:  *bit++ = 'l'; break;
+        case S_IFCHR:  *bit++ = 'c'; break;
+        case S_IFBLK:  *bit++ = 'b'; break;
+        case S_IFIFO:  *bit++ = 'p'; break;
+        case S_IFSOCK: *bit++ = 's'; break;
+        default:       *bit++ = '-'; break;
+        }
+
+        *bit++ = (S_IRUSR & mode) ? 'r' : '-';
+        *bit++ = (S_IWUSR & mode) ? 'w' : '-';
+        *bit++ = (S_IXUSR & mode) ? 'x' : '-';
+
+        *bit++ = (S_IRGRP & mode) ? 'r' : '-';
+        *bit++ = (S_IWGRP & mode) ? 'w' : '-';
+        *bit++ = (S_IXGRP & mode) ? 'x' : '-';
+
+        *bit++ = (S_IROTH & mode) ? 'r' : '-';
+        *bit++ = (S_IWOTH & mode) ? 'w' : '-';
+        *bit++ = (S_IXOTH & mode) ? 'x' : '-';
+
+        return bit - p;
+}
+
+int
+n_digits(uint64_t num)
+{
+        int n = 1;
+        for (; num >= 10; num /= 10)
+                n++;
+        return n;
+}
+
+/**
+ * Right-aligned decimal in a field of 'width' (wider numbers
+ * just take the room they need).
+ */
+size_t
+put_uint(char *p, uint64_t num, int width)
+{
+        int len = n_digits(num);
+        if (width < len)
+                width = len;
+
+        memset(p, ' ', width - len);
+        char *digit = p + width;
+        do {
+                *--digit = '0' + num % 10;
+                num /= 10;
+        } while (num);
+
+        return width;
+}
+
+/**
+ * Left-aligned string padded with spaces up to 'width'.
+ */
+size_t
+put_str(char *p, const char *str, size_t len, size_t width)
+{
+        memcpy(p, str, len);
+        if (width <= len)
+                return len;
+
+        memset(p + len, ' ', width - len);
+        return width;
+}
+
+/**
+ * According to perf stat 'getgrgid' and 'getpwuid'
+ * runs incredibly slow.
+ *
+ * That is why we need to use cache for this information.
+ * Original 'ls' and 'myls' comparation is shown below.
+ * They have _practically_ the same performance :)
+ *
+ * Performance counter stats for 'ls /home -Rl' (5 runs):
+ *
+ *            397,40 msec task-clock:u              #    0,918 CPUs utilized            ( +-  0,70% )
+ *                 0      context-switches:u        #    0,000 /sec
+ *                 0      cpu-migrations:u          #    0,000 /sec
+ *               419      page-faults:u             #    1,040 K/sec                    ( +-  0,18% )
+ *       562 704 860      cycles:u                  #    1,397 GHz                      ( +-  1,32% )
+ *     1 217 338 279      instructions:u            #    2,12  insn per cycle           ( +-  0,00% )
+ *       235 287 339      branches:u                #  583,992 M/sec                    ( +-  0,00% )
+ *         2 468 163      branch-misses:u           #    1,05% of all branches          ( +-  1,00% )
+ *
+ *           0,43269 +- 0,00216 seconds time elapsed  ( +-  0,50% )
+ *
+ *
+ * Performance counter stats for './myls /home -Rl' (5 runs):
+ *
+ *            477,34 msec task-clock:u              #    0,948 CPUs utilized            ( +-  0,91% )
+ *                 0      context-switches:u        #    0,000 /sec
+ *                 0      cpu-migrations:u          #    0,000 /sec
+ *               210      page-faults:u             #  443,166 /sec                     ( +-  0,38% )
+ *       399 541 759      cycles:u                  #    0,843 GHz                      ( +-  1,68% )
+ *       769 014 373      instructions:u            #    1,92  insn per cycle           ( +-  0,01% )
+ *       165 339 951      branches:u                #  348,919 M/sec                    ( +-  0,01% )
+ *           988 326      branch-misses:u           #    0,60% of all branches          ( +-  3,94% )
+ *
+ *           0,50354 +- 0,00421 seconds time elapsed  ( +-  0,84% )
+ *
+ * 'make bench BENCH_ARGS=ls' repeats the comparison on generated trees.
+ */
+#define NAMES_ARENA 0x1000
+
+/**
+ * The cache used to be a 256-entry direct-mapped table keeping pointers
+ * returned by getpwuid/getgrgid. Those point to static storage which
+ * is overwritten by the next call, and colliding ids evicted each other.
+ *
+ * Now it is an open-addressing table with linear probing, and names
+ * are copied into an append-only arena, so returned pointers stay valid
+ * forever. Unknown ids are cached too (as NULL), they are the slowest
+ * lookups of all.
+ */
+struct name_slot {
+        uint32_t id;
+        uint32_t used;
+        const char *name;
+};
+
+struct arena {
+        struct arena *next;
+        size_t size;
+        char data[NAMES_ARENA];
+};
+
+struct name_cache {
+        struct name_slot *slots;
+        size_t capacity;
+        size_t size;
+        struct arena *arena;
+        pthread_mutex_t mutex;
+};
+
+static struct name_cache users  = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+static struct name_cache groups = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static const char *
+arena_strdup(struct arena **arena, const char *str)
+{
+        size_t len = strlen(str) + 1;
+        if (len > NAMES_ARENA)
+                return NULL;
+
+        if (!*arena || NAMES_ARENA - (*arena)->size < len) {
+                struct arena *fresh = malloc(sizeof(struct arena));
+                if (!fresh)
+                        return NULL;
+
+                fresh->next = *arena;
+                fresh->size = 0;
+                *arena = fresh;
+        }
+
+        char *copy = memcpy((*arena)->data + (*arena)->size, str, len);
+        (*arena)->size += len;
+        return copy;
+}
+
+static inline size_t
+name_hash(uint32_t id, size_t capacity)
+{
+        /* Fibonacci hashing: consecutive ids spread over the table */
+        return (size_t)((id * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+static struct name_slot *
+name_find(struct name_cache *cache, uint32_t id)
+{
+        if (!cache->capacity)
+                return NULL;
+
+        for (size_t i = name_hash(id, cache->capacity);; i = (i + 1) & (cache->capacity - 1)) {
+                struct name_slot *slot = &cache->slots[i];
+                if (!slot->used || slot->id == id)
+                        return slot;
+        }
+}
+
+/**
+ * Keep load factor below 1/2, so probe sequences stay short.
+ * Returns:
+ *      slot for id (maybe already used), NULL on allocation failure.
+ */
+static struct name_slot *
+name_insert(struct name_cache *cache, uint32_t id)
+{
+        if ((cache->size + 1) * 2 > cache->capacity) {
+                size_t capacity = cache->capacity ? cache->capacity << 1 : 0x100;
+                struct name_slot *slots = calloc(capacity, sizeof(struct name_slot));
+                if (!slots)
+                        return NULL;
+
+                struct name_cache grown = {.slots = slots, .capacity = capacity};
+                for (size_t i = 0; i != cache->capacity; i++)
+                        if (cache->slots[i].used)
+                                *name_find(&grown, cache->slots[i].id) = cache->slots[i];
+
+                free(cache->slots);
+                cache->slots = slots;
+                cache->capacity = capacity;
+        }
+
+        struct name_slot *slot = name_find(cache, id);
+        if (!slot->used) {
+                slot->used = 1;
+                slot->id = id;
+                slot->name = NULL;
+                cache->size++;
+        }
+
+        return slot;
+}
+
+/**
+ * Reentrant NSS lookups: the result is copied out of 'buf' into the arena.
+ */
+static const char *
+lookup_user(struct arena **arena, uint32_t uid)
+{
+        char buf[0x400];
+        struct passwd pwd, *res = NULL;
+        if (getpwuid_r(uid, &pwd, buf, sizeof(buf), &res) || !res)
+                return NULL;
+
+        return arena_strdup(arena, res->pw_name);
+}
+
+static const char *
+lookup_group(struct arena **arena, uint32_t gid)
+{
+        /* Groups carry member lists, those may be long */
+        size_t bufsz = 0x400;
+        for (;;) {
+                char *buf = malloc(bufsz);
+                if (!buf)
+                        return NULL;
+
+                struct group grp, *res = NULL;
+                int error = getgrgid_r(gid, &grp, buf, bufsz, &res);
+                const char *name = (!error && res) ? arena_strdup(arena, res->gr_name) : NULL;
+                free(buf);
+
+                if (error != ERANGE)
+                        return name;
+
+                bufsz <<= 1;
+        }
+}
+
+const char *
+get_cached(struct name_cache *cache, uint32_t id,
+           const char *(*miss)(struct arena **arena, uint32_t id))
+{
+        pthread_mutex_lock(&cache->mutex);
+
+        struct name_slot *slot = name_find(cache, id);
+        if (!slot || !slot->used) {
+                const char *name = miss(&cache->arena, id);
+                slot = name_insert(cache, id);
+                if (slot)
+                        slot->name = name;
+
+                pthread_mutex_unlock(&cache->mutex);
+                return name;
+        }
+
+        const char *name = slot->name;
+        pthread_mutex_unlock(&cache->mutex);
+        return name;
+}
+
+/**
+ * Stream a passwd(5)/group(5)-like file once and fill the cache:
+ * name:passwd:id:...
+ * The first line for an id wins, as with getpwuid(). Ids served
+ * by other NSS sources still go through the regular lookup on miss.
+ */
+void
+preload(struct name_cache *cache, const char *path)
+{
+        FILE *file = fopen(path, "re");
+        if (!file)
+                return;
+
+        pthread_mutex_lock(&cache->mutex);
+
+        char *line = NULL;
+        size_t len = 0;
+        while (getline(&line, &len, file) != -1) {
+                char *save = NULL;
+                char *name = strtok_r(line, ":", &save);
+                char *pass = strtok_r(NULL, ":", &save);
+                char *id = strtok_r(NULL, ":", &save);
+                if (!name || !pass || !id || *name == '+' || *name == '-')
+                        continue;
+
+                char *end = NULL;
+                unsigned long value = strtoul(id, &end, 10);
+                if (end == id || value > UINT32_MAX)
+                        continue;
+
+                struct name_slot *slot = name_insert(cache, value);
+                if (slot && !slot->name)
+                        slot->name = arena_strdup(&cache->arena, name);
+        }
+
+        free(line);
+        pthread_mutex_unlock(&cache->mutex);
+        fclose(file);
+}
+
+/**
+ * Returns:
+ *      user/group name, or NULL if it has no name
+ *      or -n is given (the numeric id is printed then).
+ */
+const char *
+get_gid(gid_t gid)
+{
+        return opts.numeric_uid_gid ? NULL : get_cached(&groups, gid, lookup_group);
+}
+
 const char *
-get_time(time_t time)
+get_uid(uid_t uid)
+{
+        return opts.numeric_uid_gid ? NULL : get_cached(&users, uid, lookup_user);
+}
+
+/**
+ * Metadata we actually print. Filled from statx()
+ * with only the fields requested by the current options.
+ */
+struct meta {
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        off_t size;
+        time_t mtime;
+        long mtime_nsec;
+
+        /* Disk usage mode only */
+        dev_t dev;
+        ino_t ino;
+        nlink_t nlink;
+        blkcnt_t blocks;
+};
+
+/**
+ * Only ask the filesystem for what the output needs.
+ * Short format needs nothing at all, unless sorted by time or size.
+ */
+static unsigned
+stat_mask()
+{
+        if (opts.summarize)
+                return STATX_TYPE | STATX_SIZE | STATX_BLOCKS | STATX_NLINK | STATX_INO;
+
+        unsigned sort_mask = opts.sort == SORT_TIME ? STATX_MTIME
+                           : opts.sort == SORT_SIZE ? STATX_SIZE : 0;
+        if (!opts.long_listing)
+                return sort_mask;
+
+        return STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME;
+}
+
+/**
+ * AT_STATX_DONT_SYNC: take cached attributes, network and FUSE
+ * filesystems skip the round trip to revalidate them.
+ */
+#define STAT_FLAGS (AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC)
+
+static void
+meta_from_statx(struct meta *meta, const struct statx *stx)
+{
+        meta->mode = stx->stx_mode;
+        meta->uid = stx->stx_uid;
+        meta->gid = stx->stx_gid;
+        meta->size = stx->stx_size;
+        meta->mtime = stx->stx_mtime.tv_sec;
+        meta->mtime_nsec = stx->stx_mtime.tv_nsec;
+        meta->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+        meta->ino = stx->stx_ino;
+        meta->nlink = stx->stx_nlink;
+        meta->blocks = stx->stx_blocks;
+}
+
+/**
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
+int
+lookup(int dir_fd, const char *name, unsigned mask, struct meta *meta)
+{
+        assert(name && meta);
+
+        struct statx stx;
+        if (statx(dir_fd, name, STAT_FLAGS, mask, &stx) == -1)
+                return errno;
+
+        meta_from_statx(meta, &stx);
+        return 0;
+}
+
+/**
+ * Minimal io_uring for batched statx in big directories:
+ * the kernel may look up many entries concurrently,
+ * instead of one blocking syscall per entry.
+ *
+ * No liburing, just the three mmapped regions.
+ */
+#define URING_DEPTH 256
+
+struct uring {
+        int fd;
+        unsigned n_entries;
+
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void *sq_ptr;
+        void *cq_ptr;
+        size_t sq_sz;
+        size_t cq_sz;
+
+        struct statx *bufs;
+        size_t sqes_sz;
+};
+
+/* Rings are not shared between walker threads */
+static __thread struct uring uring = {.fd = -1};
+static __thread int uring_broken;
+
+/* Tears down a ring, also a partially constructed one */
+void
+uring_dtor(struct uring *ring)
+{
+        assert(ring);
+
+        if (ring->fd == -1)
+                return;
+
+        free(ring->bufs);
+        if (ring->sqes && ring->sqes != MAP_FAILED)
+                munmap(ring->sqes, ring->sqes_sz);
+        if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+                munmap(ring->cq_ptr, ring->cq_sz);
+        if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+                munmap(ring->sq_ptr, ring->sq_sz);
+        close(ring->fd);
+
+        *ring = (struct uring) {.fd = -1};
+}
+
+int
+uring_ctor(struct uring *ring, unsigned depth)
+{
+        assert(ring);
+
+        struct io_uring_params params = {0};
+        ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+        if (ring->fd == -1)
+                return errno;
+
+        ring->n_entries = params.sq_entries;
+        ring->sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        int single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+                ring->sq_sz = ring->cq_sz = ring->sq_sz > ring->cq_sz ? ring->sq_sz : ring->cq_sz;
+
+        ring->sq_ptr = mmap(NULL, ring->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED)
+                goto fail;
+
+        ring->cq_ptr = single ? ring->sq_ptr
+                              : mmap(NULL, ring->cq_sz, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+                goto fail;
+
+        ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_sz,
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+                goto fail;
+
+        ring->bufs = calloc(params.sq_entries, sizeof(struct statx));
+        if (!ring->bufs)
+                goto fail;
+
+        char *sq = ring->sq_ptr;
+        ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+        ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+        char *cq = ring->cq_ptr;
+        ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+        ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+        ring->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        return 0;
+
+fail:
+        {
+                int saved_errno = errno;
+                uring_dtor(ring);
+                return saved_errno;
+        }
+}
+
+/**
+ * Entry of the directory being listed.
+ */
+struct item {
+        const char *name;
+        unsigned char type;
+        ino_t ino;
+        int error;
+        struct meta meta;
+
+        /* Resolved while measuring columns, NULL prints the id */
+        const char *owner;
+        const char *group;
+        size_t owner_len;
+        size_t group_len;
+};
+
+/**
+ * Column widths of one block. Computed per directory like GNU ls
+ * does, so rows align without a pass over the whole tree.
+ */
+struct widths {
+        size_t owner;
+        size_t group;
+        int size;
+        int ino;
+};
+
+void
+measure(struct item *items, size_t n_items, struct widths *widths)
+{
+        assert(items && widths);
+
+        memset(widths, 0, sizeof(*widths));
+        if (!opts.long_listing && !opts.inode)
+                return;
+
+        for (size_t i = 0; i != n_items; i++) {
+                struct item *item = &items[i];
+                if (item->error)
+                        continue;
+
+                int ino = n_digits(item->ino);
+                if (opts.inode && ino > widths->ino)
+                        widths->ino = ino;
+
+                if (!opts.long_listing)
+                        continue;
+
+                item->owner = get_uid(item->meta.uid);
+                item->group = get_gid(item->meta.gid);
+                item->owner_len = item->owner ? strlen(item->owner) : (size_t)n_digits(item->meta.uid);
+                item->group_len = item->group ? strlen(item->group) : (size_t)n_digits(item->meta.gid);
+
+                if (item->owner_len > widths->owner)
+                        widths->owner = item->owner_len;
+                if (item->group_len > widths->group)
+                        widths->group = item->group_len;
+
+                int size = n_digits(item->meta.size);
+                if (size > widths->size)
+                        widths->size = size;
+        }
+}
+
+static size_t
+put_id(char *p, const char *name, size_t len, unsigned id, size_t width)
+{
+        if (name)
+                return put_str(p, name, len, width);
+
+        len = put_uint(p, id, 0);
+        if (width <= len)
+                return len;
+
+        memset(p + len, ' ', width - len);
+        return width;
+}
+
+/**
+ * Format one row straight into the block: a single reserve,
+ * no printf and no allocations on the way.
+ * Returns:
+ *      0 on success, errno if the buffer could not grow.
+ */
+int
+format_item(struct buf *out, const struct item *item, const struct widths *widths)
+{
+        assert(out && item && widths);
+
+        size_t name_len = strlen(item->name);
+        size_t ino = opts.inode ? sizeof("18446744073709551615") : 0;
+        if (!opts.long_listing) {
+                if (buf_reserve(out, ino + name_len + 1))
+                        return errno;
+
+                char *p = out->data + out->size;
+                char *start = p;
+                if (opts.inode) {
+                        p += put_uint(p, item->ino, widths->ino);
+                        *p++ = ' ';
+                }
+
+                memcpy(p, item->name, name_len);
+                p += name_len;
+                *p++ = ' ';
+                out->size += p - start;
+                return 0;
+        }
+
+        size_t row = ino + sizeof("drwxrwxrwx") + widths->group + 1 + widths->owner + 1
+                   + sizeof("18446744073709551615") + sizeof(date_cache.str) + name_len + 1;
+        if (buf_reserve(out, row))
+                return errno;
+
+        const struct meta *meta = &item->meta;
+        char *p = out->data + out->size;
+        char *start = p;
+
+        if (opts.inode) {
+                p += put_uint(p, item->ino, widths->ino);
+                *p++ = ' ';
+        }
+
+        p += put_mode(p, meta->mode);
+        *p++ = ' ';
+        p += put_id(p, item->group, item->group_len, meta->gid, widths->group);
+        *p++ = ' ';
+        p += put_id(p, item->owner, item->owner_len, meta->uid, widths->owner);
+        *p++ = ' ';
+        p += put_uint(p, meta->size, widths->size);
+        *p++ = ' ';
+        p += put_time(p, meta->mtime);
+        *p++ = ' ';
+        memcpy(p, item->name, name_len);
+        p += name_len;
+        *p++ = '\n';
+
+        out->size += p - start;
+        return 0;
+}
+
+/**
+ * Format a whole block: widths first, then rows.
+ * Entries that failed to stat are reported to 'err' instead.
+ */
+void
+format_items(struct buf *out, struct buf *err, const char *dir,
+             struct item *items, size_t n_items)
+{
+        struct widths widths;
+        measure(items, n_items, &widths);
+
+        for (size_t i = 0; i != n_items; i++) {
+                if (items[i].error) {
+                        buf_printf(err, "%s/%s: %s\n", dir, items[i].name,
+                                   strerror(items[i].error));
+                        continue;
+                }
+
+                format_item(out, &items[i], &widths);
+        }
+
+        if (!opts.long_listing)
+                buf_printf(out, "\n");
+}
+
+/**
+ * statx all entries through the ring in waves of ring size.
+ * Returns:
+ *      0 on success, errno if the ring itself failed or cannot statx
+ *      (entries are then left for the synchronous path). Either way
+ *      nothing is left in flight, so the ring can be torn down.
+ */
+int
+uring_stat(struct uring *ring, int dir_fd, struct item *ents, size_t n_ents, unsigned mask)
+{
+        assert(ring && ents);
+
+        int unsupported = 0;
+        for (size_t base = 0; base < n_ents; base += ring->n_entries) {
+                unsigned n_wave = (n_ents - base < ring->n_entries) ? n_ents - base : ring->n_entries;
+
+                unsigned tail = *ring->sq_tail;
+                for (unsigned i = 0; i != n_wave; i++, tail++) {
+                        unsigned idx = tail & *ring->sq_mask;
+                        struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+                        memset(sqe, 0, sizeof(*sqe));
+                        sqe->opcode = IORING_OP_STATX;
+                        sqe->fd = dir_fd;
+                        sqe->addr = (uintptr_t)ents[base + i].name;
+                        sqe->len = mask;
+                        sqe->off = (uintptr_t)&ring->bufs[i];
+                        sqe->statx_flags = STAT_FLAGS;
+                        sqe->user_data = i;
+
+                        ring->sq_array[idx] = idx;
+                }
+
+                atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail, memory_order_release);
+
+                /*
+                 * Submission stops at an entry the kernel rejects, the rest is resubmitted.
+                 * After a failed enter only the entries in flight are waited for:
+                 * the kernel writes their results into the buffers.
+                 */
+                unsigned n_submitted = 0;
+                int error = 0;
+                for (unsigned n_done = 0; n_done != n_wave;) {
+                        unsigned to_submit = error ? 0 : n_wave - n_submitted;
+                        long ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                                           IORING_ENTER_GETEVENTS, NULL, 0);
+                        if (ret == -1 && errno != EINTR) {
+                                if (error) {
+                                        /* Cannot wait for them, leave the buffers to the kernel */
+                                        ring->bufs = NULL;
+                                        return error;
+                                }
+                                error = errno;
+                        }
+                        if (ret > 0)
+                                n_submitted += ret;
+
+                        unsigned head = *ring->cq_head;
+                        unsigned cq_tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail,
+                                                                memory_order_acquire);
+                        for (; head != cq_tail; head++, n_done++) {
+                                const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                                struct item *ent = &ents[base + cqe->user_data];
+
+                                /* Kernels before 5.6 have io_uring, but not statx in it */
+                                if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+                                        unsupported = -cqe->res;
+
+                                ent->error = cqe->res < 0 ? -cqe->res : 0;
+                                if (!ent->error)
+                                        meta_from_statx(&ent->meta, &ring->bufs[cqe->user_data]);
+                        }
+
+                        atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head,
+                                              memory_order_release);
+
+                        /*
+                         * Nothing in flight writes to the buffers anymore. Entries
+                         * left unsubmitted do not matter: the ring is dropped.
+                         */
+                        if ((error || unsupported) && n_done >= n_submitted)
+                                return error ? error : unsupported;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Fill metadata of all entries with the requested mask.
+ * Batched through io_uring if enabled and available.
+ */
+void
+stat_entries(int dir_fd, struct item *ents, size_t n_ents, unsigned mask)
+{
+        if (!mask)
+                return;
+
+        if (opts.uring && !uring_broken && uring.fd == -1 && uring_ctor(&uring, URING_DEPTH))
+                uring_broken = 1;
+
+        if (opts.uring && !uring_broken) {
+                if (!uring_stat(&uring, dir_fd, ents, n_ents, mask))
+                        return;
+
+                /* Do not try again with every directory */
+                uring_broken = 1;
+                uring_dtor(&uring);
+        }
+
+        for (size_t i = 0; i != n_ents; i++)
+                ents[i].error = lookup(dir_fd, ents[i].name, mask, &ents[i].meta);
+}
+
+/**
+ * Sorting. Comparing entries through 'strcoll' and their metadata
+ * costs a lot on huge directories, so every entry gets a compact
+ * record with a precomputed key first:
+ *
+ *      name:    collation key ('strxfrm') compared with strcmp, its
+ *               first bytes packed into an integer to skip most calls;
+ *      time:    nanoseconds, size: bytes, both LSD radix sorted;
+ *      version: 'filevercmp' rules of GNU ls on the names, no key
+ *               to precompute.
+ *
+ * Names are addressed by offsets into an arena: the getdents
+ * buffer itself, or the collation keys if the locale needs them.
+ */
+struct record {
+        uint64_t key;
+        uint32_t name;
+        uint32_t index;
+};
+
+/* Byte order is collation order in these, 'strxfrm' is a copy */
+static int collate_bytes = 1;
+
+/* Below this qsort beats the radix histogram passes */
+#define RADIX_MIN 0x100
+
+static uint64_t
+name_prefix(const char *name)
+{
+        uint64_t prefix = 0;
+        for (int i = 0; i != 8 && name[i]; i++)
+                prefix |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+        return prefix;
+}
+
+static int
+cmp_names(const void *lhs_p, const void *rhs_p, void *names_p)
+{
+        const struct record *lhs = lhs_p;
+        const struct record *rhs = rhs_p;
+        const char *names = names_p;
+        return strcmp(names + lhs->name, names + rhs->name);
+}
+
+static int
+cmp_keys(const void *lhs_p, const void *rhs_p, void *names_p)
+{
+        const struct record *lhs = lhs_p;
+        const struct record *rhs = rhs_p;
+        if (lhs->key != rhs->key)
+                return lhs->key < rhs->key ? -1 : 1;
+
+        return cmp_names(lhs_p, rhs_p, names_p);
+}
+
+/**
+ * Version sort as GNU ls does it (gnulib 'filevercmp'), which is not
+ * 'strverscmp': suffixes like ".tar.gz" are compared only when the rest
+ * is equal, '~' sorts before everything, even the end of the name, and
+ * letters sort before other non-digits.
+ */
+
+/* ASCII classes: the rules do not depend on the locale */
+static inline int c_isdigit(int c) { return c >= '0' && c <= '9'; }
+static inline int c_isalpha(int c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; }
+static inline int c_isalnum(int c) { return c_isdigit(c) || c_isalpha(c); }
+
+/* Length of 's' without its suffix, the longest match of (\.[A-Za-z~][A-Za-z0-9~]*)*$ */
+static size_t
+ver_prefixlen(const char *s, size_t len)
+{
+        size_t prefixlen = 0;
+        for (size_t i = 0; i != len;) {
+                prefixlen = ++i;
+                while (i + 1 < len && s[i] == '.' && (c_isalpha(s[i + 1]) || s[i + 1] == '~'))
+                        for (i += 2; i < len && (c_isalnum(s[i]) || s[i] == '~'); i++)
+                                ;
+        }
+        return prefixlen;
+}
+
+static int
+ver_order(const char *s, size_t pos, size_t len)
+{
+        if (pos == len)
+                return -1;
+
+        unsigned char c = s[pos];
+        if (c_isdigit(c))
+                return 0;
+        if (c_isalpha(c))
+                return c;
+        if (c == '~')
+                return -2;
+        return c + 0x100;
+}
+
+/* Debian version comparison: non-digit runs by ver_order, digit runs numerically */
+static int
+ver_cmp(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+        size_t i = 0, j = 0;
+        while (i < a_len || j < b_len) {
+                while ((i < a_len && !c_isdigit(a[i])) ||
+                       (j < b_len && !c_isdigit(b[j]))) {
+                        int a_c = ver_order(a, i, a_len);
+                        int b_c = ver_order(b, j, b_len);
+                        if (a_c != b_c)
+                                return a_c - b_c;
+                        i++, j++;
+                }
+
+                while (i < a_len && a[i] == '0')
+                        i++;
+                while (j < b_len && b[j] == '0')
+                        j++;
+
+                int first_diff = 0;
+                for (; i < a_len && j < b_len && c_isdigit(a[i]) &&
+                       c_isdigit(b[j]); i++, j++)
+                        if (!first_diff)
+                                first_diff = a[i] - b[j];
+
+                if (i < a_len && c_isdigit(a[i]))
+                        return 1;
+                if (j < b_len && c_isdigit(b[j]))
+                        return -1;
+                if (first_diff)
+                        return first_diff;
+        }
+        return 0;
+}
+
+static int
+filevercmp(const char *a, const char *b)
+{
+        /* "." first, then "..", then other dot names, then the rest */
+        if (a[0] == '.' || b[0] == '.') {
+                if (a[0] != b[0])
+                        return a[0] == '.' ? -1 : 1;
+
+                int a_rank = !a[1] ? 0 : (a[1] == '.' && !a[2]) ? 1 : 2;
+                int b_rank = !b[1] ? 0 : (b[1] == '.' && !b[2]) ? 1 : 2;
+                if (a_rank != 2 || b_rank != 2)
+                        return a_rank - b_rank;
+        }
+
+        size_t a_len = strlen(a);
+        size_t b_len = strlen(b);
+        size_t a_prefix = ver_prefixlen(a, a_len);
+        size_t b_prefix = ver_prefixlen(b, b_len);
+
+        int diff = ver_cmp(a, a_prefix, b, b_prefix);
+        if (diff || (a_prefix == a_len && b_prefix == b_len))
+                return diff;
+
+        return ver_cmp(a, a_len, b, b_len);
+}
+
+static int
+cmp_versions(const void *lhs_p, const void *rhs_p, void *names_p)
+{
+        const struct record *lhs = lhs_p;
+        const struct record *rhs = rhs_p;
+        const char *names = names_p;
+
+        int diff = filevercmp(names + lhs->name, names + rhs->name);
+        return diff ? diff : strcmp(names + lhs->name, names + rhs->name);
+}
+
+/**
+ * Stable LSD radix sort on 'key', 8 bits per pass. All histograms
+ * are built in one pass, digits equal in every record are skipped:
+ * mtimes of one directory rarely differ in their upper bytes.
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
+static int
+radix_sort(struct record *recs, size_t n_recs)
+{
+        struct record *tmp = malloc(n_recs * sizeof(struct record));
+        if (!tmp)
+                return errno;
+
+        size_t (*hist)[0x100] = calloc(8, sizeof(*hist));
+        if (!hist)
+                return free(tmp), errno;
+
+        for (size_t i = 0; i != n_recs; i++)
+                for (int digit = 0; digit != 8; digit++)
+                        hist[digit][(recs[i].key >> (8 * digit)) & 0xff]++;
+
+        struct record *src = recs;
+        struct record *dst = tmp;
+        for (int digit = 0; digit != 8; digit++) {
+                int shift = 8 * digit;
+                if (hist[digit][(recs[0].key >> shift) & 0xff] == n_recs)
+                        continue;
+
+                size_t offset = 0;
+                for (int i = 0; i != 0x100; i++) {
+                        size_t count = hist[digit][i];
+                        hist[digit][i] = offset;
+                        offset += count;
+                }
+
+                for (size_t i = 0; i != n_recs; i++)
+                        dst[hist[digit][(src[i].key >> shift) & 0xff]++] = src[i];
+
+                struct record *swap = src;
+                src = dst;
+                dst = swap;
+        }
+
+        if (src != recs)
+                memcpy(recs, src, n_recs * sizeof(struct record));
+
+        free(hist);
+        free(tmp);
+        return 0;
+}
+
+/**
+ * Radix sort leaves equal keys in directory order, GNU ls
+ * breaks ties by name.
+ */
+static void
+sort_ties(struct record *recs, size_t n_recs, const char *names)
+{
+        for (size_t begin = 0, end = 0; begin < n_recs; begin = end) {
+                for (end = begin + 1; end != n_recs && recs[end].key == recs[begin].key; end++)
+                        ;
+
+                if (end - begin > 1)
+                        qsort_r(recs + begin, end - begin, sizeof(struct record), cmp_names,
+                                (void *)names);
+        }
+}
+
+static uint64_t
+sort_key(const struct item *item)
+{
+        if (item->error)
+                return UINT64_MAX;
+
+        /* Newest and largest first: invert the keys */
+        if (opts.sort == SORT_SIZE)
+                return ~(uint64_t)item->meta.size;
+
+        int64_t nsec = (int64_t)item->meta.mtime * 1000000000 + item->meta.mtime_nsec;
+        return ~((uint64_t)nsec ^ (UINT64_C(1) << 63));
+}
+
+/**
+ * Reorder entries of one directory. 'names' is the arena
+ * entry names point into.
+ * Returns:
+ *      0 on success, errno otherwise (entries are left unsorted).
+ */
+int
+sort_items(struct item *items, size_t n_items, const char *names)
+{
+        if (opts.sort == SORT_NONE || n_items < 2)
+                return 0;
+
+        int error = ENOMEM;
+        struct record *recs = calloc(n_items, sizeof(struct record));
+        struct item *sorted = malloc(n_items * sizeof(struct item));
+        struct buf keys = {0};
+        if (!recs || !sorted)
+                goto out;
+
+        /* Collation keys go to their own arena, unless they are the names */
+        int xfrm = !collate_bytes && opts.sort != SORT_VERSION;
+        for (size_t i = 0; i != n_items; i++) {
+                const char *name = items[i].name;
+                recs[i].index = i;
+                recs[i].name = name - names;
+
+                if (xfrm) {
+                        size_t len = strxfrm(NULL, name, 0);
+                        if (buf_reserve(&keys, len + 1))
+                                goto out;
+
+                        strxfrm(keys.data + keys.size, name, len + 1);
+                        recs[i].name = keys.size;
+                        keys.size += len + 1;
+                }
+        }
+
+        const char *arena = xfrm ? keys.data : names;
+        switch (opts.sort) {
+        case SORT_NAME:
+                for (size_t i = 0; i != n_items; i++)
+                        recs[i].key = name_prefix(arena + recs[i].name);
+                qsort_r(recs, n_items, sizeof(struct record), cmp_keys, (void *)arena);
+                break;
+        case SORT_VERSION:
+                qsort_r(recs, n_items, sizeof(struct record), cmp_versions, (void *)arena);
+                break;
+        default:
+                for (size_t i = 0; i != n_items; i++)
+                        recs[i].key = sort_key(&items[i]);
+
+                if (n_items < RADIX_MIN) {
+                        qsort_r(recs, n_items, sizeof(struct record), cmp_keys, (void *)arena);
+                } else {
+                        if ((error = radix_sort(recs, n_items)))
+                                goto out;
+                        sort_ties(recs, n_items, arena);
+                }
+                break;
+        }
+
+        for (size_t i = 0; i != n_items; i++) {
+                size_t pos = opts.reverse ? n_items - 1 - i : i;
+                sorted[pos] = items[recs[i].index];
+        }
+
+        memcpy(items, sorted, n_items * sizeof(struct item));
+        error = 0;
+out:
+        buf_dtor(&keys);
+        free(sorted);
+        free(recs);
+        return error;
+}
+
+enum exit_status {
+        OK      = 0,
+        MINOR   = 1,
+        TROUBLE = 2,
+};
+
+/**
+ * Raw directory contents: getdents64 records back to back.
+ */
+struct dirbuf {
+        char *data;
+        size_t size;
+        size_t capacity;
+};
+
+#define for_each_dirent(ent, db)                                                \
+        for (const struct dirent64 *ent = (const struct dirent64 *)(db)->data; \
+             (const char *)ent < (db)->data + (db)->size;                      \
+             ent = (const struct dirent64 *)((const char *)ent + ent->d_reclen))
+
+/**
+ * Read the whole directory once with raw getdents64.
+ * Large buffer means a few syscalls even for huge directories,
+ * and no second pass for recursion.
+ */
+int
+read_dir(int fd, struct dirbuf *db)
+{
+        assert(db);
+
+        const size_t chunk = 0x10000;
+        db->size = 0;
+
+        for (;;) {
+                if (db->capacity - db->size < chunk) {
+                        size_t capacity = db->capacity ? db->capacity << 1 : chunk << 1;
+                        char *data = realloc(db->data, capacity);
+                        if (!data)
+                                return errno;
+
+                        db->data = data;
+                        db->capacity = capacity;
+                }
+
+                ssize_t n_read = getdents64(fd, db->data + db->size, db->capacity - db->size);
+                if (n_read == -1)
+                        return errno;
+                if (n_read == 0)
+                        return 0;
+
+                db->size += n_read;
+        }
+}
+
+static int
+is_hidden(const char *name)
+{
+        return !opts.all && *name == '.';
+}
+
+static int
+is_dots(const char *name)
+{
+        return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+/**
+ * Disk usage mode ('--summarize'): entries are not listed, their
+ * blocks and sizes are added up per subtree instead, like 'du -s'.
+ *
+ * Files with several links are counted once. Their (dev, ino) go
+ * to a set shared by all walker threads: open addressing again,
+ * split into shards with their own locks, so that workers rarely
+ * wait for each other.
+ */
+#define INODE_SHARDS 0x40
+
+struct inode_slot {
+        uint64_t dev;
+        uint64_t ino;
+        int used;
+};
+
+struct inode_shard {
+        pthread_mutex_t mutex;
+        struct inode_slot *slots;
+        size_t capacity;
+        size_t size;
+};
+
+static struct inode_shard inodes[INODE_SHARDS] = {
+        [0 ... INODE_SHARDS - 1] = {.mutex = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static inline uint64_t
+inode_hash(uint64_t dev, uint64_t ino)
+{
+        uint64_t hash = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ull;
+        return hash ^ (hash >> 29);
+}
+
+static struct inode_slot *
+inode_find(struct inode_shard *shard, uint64_t hash, uint64_t dev, uint64_t ino)
+{
+        size_t mask = shard->capacity - 1;
+        for (size_t i = (hash >> 6) & mask;; i = (i + 1) & mask) {
+                struct inode_slot *slot = &shard->slots[i];
+                if (!slot->used || (slot->dev == dev && slot->ino == ino))
+                        return slot;
+        }
+}
+
+/**
+ * Returns:
+ *      1 if the inode is seen for the first time (or there was
+ *      no memory to remember it), 0 if it was counted already.
+ */
+int
+inode_insert(dev_t dev, ino_t ino)
+{
+        uint64_t hash = inode_hash(dev, ino);
+        struct inode_shard *shard = &inodes[hash % INODE_SHARDS];
+
+        pthread_mutex_lock(&shard->mutex);
+        if ((shard->size + 1) * 2 > shard->capacity) {
+                size_t capacity = shard->capacity ? shard->capacity << 1 : 0x40;
+                struct inode_slot *slots = calloc(capacity, sizeof(struct inode_slot));
+                if (!slots) {
+                        pthread_mutex_unlock(&shard->mutex);
+                        return 1;
+                }
+
+                struct inode_shard grown = {.slots = slots, .capacity = capacity, .size = shard->size};
+                for (size_t i = 0; i != shard->capacity; i++) {
+                        struct inode_slot *old = &shard->slots[i];
+                        if (old->used)
+                                *inode_find(&grown, inode_hash(old->dev, old->ino), old->dev, old->ino) = *old;
+                }
+
+                free(shard->slots);
+                shard->slots = slots;
+                shard->capacity = capacity;
+        }
+
+        struct inode_slot *slot = inode_find(shard, hash, dev, ino);
+        int fresh = !slot->used;
+        if (fresh) {
+                *slot = (struct inode_slot){.dev = dev, .ino = ino, .used = 1};
+                shard->size++;
+        }
+
+        pthread_mutex_unlock(&shard->mutex);
+        return fresh;
+}
+
+struct usage {
+        uint64_t blocks;
+        uint64_t bytes;
+};
+
+static void
+usage_add(struct usage *usage, const struct meta *meta)
+{
+        /* Directories cannot be hard linked */
+        if (meta->nlink > 1 && !S_ISDIR(meta->mode) && !inode_insert(meta->dev, meta->ino))
+                return;
+
+        usage->blocks += meta->blocks;
+        usage->bytes += meta->size;
+}
+
+/**
+ * '1024-blocks path' like 'du -s', with '-l' the apparent size
+ * in bytes goes in between.
+ */
+void
+format_usage(struct buf *out, const struct usage *usage, const char *path)
+{
+        if (opts.long_listing)
+                buf_printf(out, "%llu\t%llu\t%s\n", (unsigned long long)(usage->blocks + 1) / 2,
+                           (unsigned long long)usage->bytes, path);
+        else
+                buf_printf(out, "%llu\t%s\n", (unsigned long long)(usage->blocks + 1) / 2, path);
+}
+
+/**
+ * Recursive listing is a tree of directory nodes.
+ *
+ * Worker threads scan nodes concurrently: read the directory,
+ * format the whole block into node's own buffers and create child
+ * nodes for subdirectories. The main thread walks the tree in the
+ * order sequential '-R' would and writes finished blocks out,
+ * scanning a node itself if no worker has taken it yet.
+ * With no workers this is exactly the sequential algorithm.
+ *
+ * Finished blocks wait in memory until the main thread reaches them,
+ * so workers stop taking nodes once WALK_AHEAD bytes are waiting.
+ * The main thread then scans what it needs itself and lets them go
+ * on as the output catches up.
+ */
+#define WALK_AHEAD (0x40 << 20)
+
+enum node_state {
+        PENDING,
+        RUNNING,
+        DONE,
+};
+
+struct node {
+        char *path;
+        enum node_state state;
+        int queued;
+        int status;
+
+        struct buf out;
+        struct buf err;
+
+        /* Disk usage of the subtree scanned so far */
+        struct usage usage;
+
+        size_t n_children;
+        struct node **children;
+};
+
+struct walker {
+        pthread_mutex_t mutex;
+        pthread_cond_t done;
+        pthread_cond_t work;
+
+        /* LIFO: first child of the latest scanned directory goes first */
+        struct node **stack;
+        size_t size;
+        size_t capacity;
+        int closed;
+
+        /* Output of DONE nodes not yet written */
+        size_t ahead;
+
+        size_t n_threads;
+        pthread_t *tids;
+
+        /* We need to print newline between 'ls' calls */
+        int indent;
+
+        /* Owned by the emitter: blocks are gathered into one write() */
+        struct buf out;
+};
+
+struct node *
+node_ctor(const char *parent, const char *name)
 {
-        static char date[0xff] = {0};
-        const struct tm *tm = localtime(&time);
+        struct node *node = calloc(1, sizeof(struct node));
+        if (!node)
+                return NULL;
+
+        if (!name) {
+                node->path = strdup(parent);
+        } else {
+                size_t len = strlen(parent);
+                const char *sep = (len && parent[len - 1] == '/') ? "" : "/";
+                if (asprintf(&node->path, "%s%s%s", parent, sep, name) == -1)
+                        node->path = NULL;
+        }
+
+        if (!node->path)
+                return free(node), NULL;
 
-        const char *fmt = "%b %d %Y %H:%M";
-        strftime(date, sizeof(date), fmt, localtime(&time));
-        return date;
+        if (strlen(node->path) >= PATH_MAX) {
+                free(node->path);
+                free(node);
+                errno = ENAMETOOLONG;
+                return NULL;
+        }
+
+        return node;
 }
 
-const char *
-get_mode(mode_t mode)
+/**
+ * Read, stat and format one directory into node's buffers.
+ * Lookups are relative to the directory fd, the path is
+ * only used for headers and messages.
+ */
+void
+scan(struct node *node)
 {
-        /* Simple but effective and clean... */
-        static char smode[] = "drwxrwxrwx";
+        assert(node);
 
-        char *bit = smode;
-        *bit++ = S_ISDIR(mode) ? 'd' : '-';
+        /* 'ls' prints directory name if -R specified */
+        if ((opts.name_dir | opts.recursive) && !opts.summarize)
+                buf_printf(&node->out, "%s:\n", node->path);
 
-        *bit++ = (S_IRUSR & mode) ? 'r' : '-';
-        *bit++ = (S_IWUSR & mode) ? 'w' : '-';
-        *bit++ = (S_IXUSR & mode) ? 'x' : '-';
+        int fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+                buf_printf(&node->err, "%s: %s\n", node->path, strerror(errno));
+                node->status = MINOR;
+                return;
+        }
 
-        *bit++ = (S_IRGRP & mode) ? 'r' : '-';
-        *bit++ = (S_IWGRP & mode) ? 'w' : '-';
-        *bit++ = (S_IXGRP & mode) ? 'x' : '-';
+        struct dirbuf db = {0};
+        int error = read_dir(fd, &db);
+        if (error) {
+                buf_printf(&node->err, "%s: %s\n", node->path, strerror(error));
+                node->status = MINOR;
+                goto out;
+        }
 
-        *bit++ = (S_IROTH & mode) ? 'r' : '-';
-        *bit++ = (S_IWOTH & mode) ? 'w' : '-';
-        *bit++ = (S_IXOTH & mode) ? 'x' : '-';
+        /* Visible entries, names point into the getdents buffer */
+        size_t n_ents = 0;
+        for_each_dirent(ent, &db)
+                n_ents++;
+
+        struct item *ents = calloc(n_ents ? n_ents : 1, sizeof(struct item));
+        if (!ents) {
+                buf_printf(&node->err, "%s: %s\n", node->path, strerror(errno));
+                node->status = MINOR;
+                goto out;
+        }
+
+        n_ents = 0;
+        for_each_dirent(ent, &db) {
+                if (is_hidden(ent->d_name) || (opts.summarize && is_dots(ent->d_name)))
+                        continue;
+
+                ents[n_ents].name = ent->d_name;
+                ents[n_ents].type = ent->d_type;
+                ents[n_ents].ino = ent->d_ino;
+                n_ents++;
+        }
+
+        unsigned mask = stat_mask();
+        stat_entries(fd, ents, n_ents, mask);
+
+        /* Children are created in this order too, so '-R' follows it */
+        assert(db.size <= UINT32_MAX);
+        if ((error = sort_items(ents, n_ents, db.data))) {
+                buf_printf(&node->err, "%s: %s\n", node->path, strerror(error));
+                node->status = MINOR;
+        }
+
+        if (!opts.summarize) {
+                format_items(&node->out, &node->err, node->path, ents, n_ents);
+        } else {
+                for (size_t i = 0; i != n_ents; i++) {
+                        if (!ents[i].error) {
+                                usage_add(&node->usage, &ents[i].meta);
+                                continue;
+                        }
+
+                        buf_printf(&node->err, "%s/%s: %s\n", node->path, ents[i].name,
+                                   strerror(ents[i].error));
+                        node->status = MINOR;
+                }
+        }
+
+        /**
+         * According to perf 'readdir' was not so efficient:
+         * we used to read every directory twice, once to print
+         * and once again after rewinddir() to recurse.
+         *
+         * perf report:
+         *     15,36%  myls     libc.so.6             [.] readdir64
+         *     10,25%  myls     [unknown]             [k] 0xffffffffb5600191
+         *      8,77%  myls     libc.so.6             [.] _IO_file_xsputn
+         *
+         * Now entries are read once, and d_type tells directories
+         * apart without stat for filesystems which fill it.
+         */
+        if ((opts.recursive || opts.summarize) && n_ents)
+                node->children = calloc(n_ents, sizeof(struct node *));
+
+        for (size_t i = 0; node->children && i != n_ents; i++) {
+                const struct item *ent = &ents[i];
+                if (is_dots(ent->name))
+                        continue;
+
+                /* Type may already be known from the listing itself */
+                unsigned char type = ent->type;
+                if (type == DT_UNKNOWN && (mask & STATX_TYPE) && !ent->error) {
+                        type = IFTODT(ent->meta.mode);
+                } else if (type == DT_UNKNOWN) {
+                        struct meta meta;
+                        if (lookup(fd, ent->name, STATX_TYPE, &meta))
+                                continue;
+
+                        type = IFTODT(meta.mode);
+                }
+
+                if (type != DT_DIR)
+                        continue;
+
+                struct node *child = node_ctor(node->path, ent->name);
+                if (!child) {
+                        buf_printf(&node->err, "%s/%s: %s\n", node->path, ent->name, strerror(errno));
+                        node->status = MINOR;
+                        continue;
+                }
+
+                /* The subdirectory's own blocks belong to its subtree */
+                if (opts.summarize && !ent->error) {
+                        child->usage.blocks = ent->meta.blocks;
+                        child->usage.bytes = ent->meta.size;
+                        node->usage.blocks -= ent->meta.blocks;
+                        node->usage.bytes -= ent->meta.size;
+                }
+
+                node->children[node->n_children++] = child;
+        }
+
+        free(ents);
+out:
+        free(db.data);
+        close(fd);
+}
+
+void
+walker_push(struct walker *walker, struct node *node)
+{
+        if (walker->size == walker->capacity) {
+                size_t capacity = walker->capacity ? walker->capacity << 1 : 0x40;
+                struct node **stack = realloc(walker->stack, capacity * sizeof(struct node *));
+                if (!stack)
+                        return; /* The emitter scans it itself */
+
+                walker->stack = stack;
+                walker->capacity = capacity;
+        }
+
+        node->queued = 1;
+        walker->stack[walker->size++] = node;
+}
 
-        return smode;
+/* Take a node back from the workers, keeping the order of the rest */
+void
+walker_unqueue(struct walker *walker, struct node *node)
+{
+        for (size_t i = walker->size; i--;) {
+                if (walker->stack[i] != node)
+                        continue;
+
+                memmove(&walker->stack[i], &walker->stack[i + 1],
+                        (walker->size - i - 1) * sizeof(struct node *));
+                walker->size--;
+                break;
+        }
+
+        node->queued = 0;
 }
 
 /**
- * According to perf stat 'getgrgid' and 'getpwuid'
- * runs incredibly slow.
- *
- * That is why we need to use cache for this information.
- * Original 'ls' and 'myls' comparation is shown below.
- * They have _practically_ the same performance :)
- *
- * Performance counter stats for 'ls /home -Rl' (5 runs):
- *
- *            397,40 msec task-clock:u              #    0,918 CPUs utilized            ( +-  0,70% )
- *                 0      context-switches:u        #    0,000 /sec
- *                 0      cpu-migrations:u          #    0,000 /sec
- *               419      page-faults:u             #    1,040 K/sec                    ( +-  0,18% )
- *       562 704 860      cycles:u                  #    1,397 GHz                      ( +-  1,32% )
- *     1 217 338 279      instructions:u            #    2,12  insn per cycle           ( +-  0,00% )
- *       235 287 339      branches:u                #  583,992 M/sec                    ( +-  0,00% )
- *         2 468 163      branch-misses:u           #    1,05% of all branches          ( +-  1,00% )
- *
- *           0,43269 +- 0,00216 seconds time elapsed  ( +-  0,50% )
- *
- *
- * Performance counter stats for './myls /home -Rl' (5 runs):
- *
- *            477,34 msec task-clock:u              #    0,948 CPUs utilized            ( +-  0,91% )
- *                 0      context-switches:u        #    0,000 /sec
- *                 0      cpu-migrations:u          #    0,000 /sec
- *               210      page-faults:u             #  443,166 /sec                     ( +-  0,38% )
- *       399 541 759      cycles:u                  #    0,843 GHz                      ( +-  1,68% )
- *       769 014 373      instructions:u            #    1,92  insn per cycle           ( +-  0,01% )
- *       165 339 951      branches:u                #  348,919 M/sec                    ( +-  0,01% )
- *           988 326      branch-misses:u           #    0,60% of all branches          ( +-  3,94% )
- *
- *           0,50354 +- 0,00421 seconds time elapsed  ( +-  0,84% )
+ * Scan the node and publish its children. Called with the mutex
+ * unlocked by whoever has switched the node to RUNNING.
  */
-#define CACHED
-#define hash_bits 8
-struct entry {
-    uint64_t key;
-    void *value;
-};
+void
+walker_scan(struct walker *walker, struct node *node)
+{
+        scan(node);
 
-static struct entry groups [1 << hash_bits];
-static struct entry passwds[1 << hash_bits];
+        pthread_mutex_lock(&walker->mutex);
+        node->state = DONE;
+        walker->ahead += node->out.size + node->err.size;
 
-void *get_cached(struct entry *cache, uint64_t key, void *(*miss)(uint64_t key))
-{
-    struct entry *ent = &cache[key & ~((~0u) << hash_bits)];
-    if (key != ent->key) {
-        ent->value = miss(key);
-        ent->key = key;
-    }
+        if (walker->n_threads) {
+                for (size_t i = node->n_children; i--;)
+                        walker_push(walker, node->children[i]);
+
+                if (node->n_children)
+                        pthread_cond_broadcast(&walker->work);
+        }
 
-    return ent->value;
+        pthread_cond_broadcast(&walker->done);
+        pthread_mutex_unlock(&walker->mutex);
 }
-#undef hash_bits
 
-const char *
-get_gid(gid_t gid)
+void *
+load_walker(void *args_p)
 {
-#ifdef CACHED
-        struct group *grp = (struct group *)get_cached(groups, gid, &getgrgid);
-#else
-        struct group *grp = getgrgid(gid);
-#endif
-        if (grp) return grp->gr_name;
+        struct walker *walker = (struct walker *)args_p;
+
+        pthread_mutex_lock(&walker->mutex);
+        for (;;) {
+                while ((!walker->size || walker->ahead >= WALK_AHEAD) && !walker->closed)
+                        pthread_cond_wait(&walker->work, &walker->mutex);
+
+                if (walker->closed)
+                        break;
+
+                struct node *node = walker->stack[--walker->size];
+                node->queued = 0;
+
+                node->state = RUNNING;
+                pthread_mutex_unlock(&walker->mutex);
+
+                walker_scan(walker, node);
+
+                pthread_mutex_lock(&walker->mutex);
+        }
+
+        pthread_mutex_unlock(&walker->mutex);
+        uring_dtor(&uring);
         return NULL;
 }
 
-const char *
-get_uid(uid_t uid)
+int
+write_all(int fd, const char *data, size_t size)
 {
-#ifdef CACHED
-        struct passwd *pwd = (struct passwd *)get_cached(passwds, uid, &getpwuid);
-#else
-        struct passwd *pwd = getpwuid(uid);
-#endif
-        if (pwd)
-                return pwd->pw_name;
-        return NULL;
+        while (size) {
+                ssize_t n_written = write(fd, data, size);
+                if (n_written == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return errno;
+                }
+
+                data += n_written;
+                size -= n_written;
+        }
+
+        return 0;
 }
 
+/* Output leaves in blocks at least this large */
+#define OUT_BLOCK 0x10000
+
 void
-info(const struct stat *st, const char *path)
+out_flush(struct walker *walker)
 {
-        assert(st);
-        assert(path);
+        write_all(STDOUT_FILENO, walker->out.data, walker->out.size);
+        walker->out.size = 0;
+}
 
-        if (!opts.long_listing) {
-                printf("%s ", path);
+/**
+ * Small blocks (most directories) are gathered, large ones
+ * go out directly without another copy.
+ */
+void
+out_write(struct walker *walker, const char *data, size_t size)
+{
+        if (!size)
+                return;
+
+        if (walker->out.size + size < OUT_BLOCK && !buf_reserve(&walker->out, size)) {
+                memcpy(walker->out.data + walker->out.size, data, size);
+                walker->out.size += size;
                 return;
         }
 
-        printf("%s ", get_mode(st->st_mode));
-        printf("%s ", get_gid(st->st_gid));
-        printf("%s ", get_uid(st->st_uid));
-        printf("%9.ld ", st->st_size);
-        printf("%s ", get_time(st->st_mtime));
-        printf("%s\n", path);
+        out_flush(walker);
+        write_all(STDOUT_FILENO, data, size);
 }
 
 int
-ls(char *const path)
+walker_ctor(struct walker *walker, size_t n_threads)
 {
-        assert(path);
+        memset(walker, 0, sizeof(*walker));
+        pthread_mutex_init(&walker->mutex, NULL);
+        pthread_cond_init(&walker->done, NULL);
+        pthread_cond_init(&walker->work, NULL);
 
-        enum exit_status {
-                OK      = 0,
-                MINOR   = 1,
-                TROUBLE = 2,
-        };
+        if (!n_threads)
+                return 0;
 
-        struct stat st;
-        if (lstat(path, &st) == -1)
-                return TROUBLE;
+        walker->tids = calloc(n_threads, sizeof(pthread_t));
+        if (!walker->tids)
+                return errno;
 
-        /* We need to print newline between 'ls' calls */
-        static int indent = 0;
-        if (indent || (indent++))
-                putchar('\n');
+        for (; walker->n_threads != n_threads; walker->n_threads++)
+                if (pthread_create(&walker->tids[walker->n_threads], NULL, load_walker, walker))
+                        break;
 
-        if (!S_ISDIR(st.st_mode)) {
-                info(&st, path);
-                if (!opts.long_listing)
-                        putchar('\n');
+        return 0;
+}
 
-                return OK;
-        }
+void
+walker_dtor(struct walker *walker)
+{
+        pthread_mutex_lock(&walker->mutex);
+        walker->closed = 1;
+        pthread_cond_broadcast(&walker->work);
+        pthread_mutex_unlock(&walker->mutex);
 
-        /* 'ls' prints directory name if -R specified */
-        if (opts.name_dir | opts.recursive)
-                printf("%s:\n", path);
+        for (size_t i = 0; i != walker->n_threads; i++)
+                pthread_join(walker->tids[i], NULL);
 
-        const struct dirent *ent = NULL;
-        struct stat ent_st;
+        /* Workers drop their rings on exit, this one is the caller's */
+        uring_dtor(&uring);
 
-        DIR *dir = opendir(path);
-        if (!dir) {
-                perror("");
-                return MINOR;
-        }
+        out_flush(walker);
+        buf_dtor(&walker->out);
 
-        assert(dir);
-        strncat(path, "/", PATH_MAX - 1);
-        size_t path_len = strlen(path);
+        free(walker->tids);
+        free(walker->stack);
+        pthread_cond_destroy(&walker->done);
+        pthread_cond_destroy(&walker->work);
+        pthread_mutex_destroy(&walker->mutex);
+}
 
-        errno = 0;
-        while ((ent = readdir(dir))) {
-                assert(ent);
-                static int first = 0;
-                if (errno) {
-                        closedir(dir);
-                        return MINOR;
-                }
+static void
+separate(struct walker *walker)
+{
+        if (walker->indent || (walker->indent++))
+                out_write(walker, "\n", 1);
+}
 
-                if (!opts.all && (*ent->d_name == '.'))
-                        continue;
+/**
+ * Write the subtree out in sequential '-R' order, freeing it on the way.
+ * Nodes sitting on the stack belong to workers: popping them later
+ * must not touch freed memory, so the emitter takes a queued node off
+ * the stack before scanning it. Only a RUNNING node is waited for.
+ * In disk usage mode the subtree total goes up to the parent.
+ * Returns:
+ *      the worst exit status of the subtree.
+ */
+int
+emit(struct walker *walker, struct node *node, struct node *parent)
+{
+        pthread_mutex_lock(&walker->mutex);
+        while (node->state != DONE) {
+                if (node->state == PENDING) {
+                        if (node->queued)
+                                walker_unqueue(walker, node);
 
-                strncat(path, ent->d_name, PATH_MAX - 1);
-                if (lstat(path, &ent_st) == -1) {
-                        path[path_len] = '\0';
-                        fprintf(stderr, "%s: %s\n", path, strerror(errno));
-                        continue;
+                        node->state = RUNNING;
+                        pthread_mutex_unlock(&walker->mutex);
+                        walker_scan(walker, node);
+                        pthread_mutex_lock(&walker->mutex);
+                } else {
+                        pthread_cond_wait(&walker->done, &walker->mutex);
                 }
+        }
+
+        int was_full = walker->ahead >= WALK_AHEAD;
+        walker->ahead -= node->out.size + node->err.size;
+        if (was_full && walker->ahead < WALK_AHEAD)
+                pthread_cond_broadcast(&walker->work);
+        pthread_mutex_unlock(&walker->mutex);
 
-                info(&ent_st, ent->d_name);
-                path[path_len] = '\0';
+        if (node->err.size) {
+                out_flush(walker);
+                write_all(STDERR_FILENO, node->err.data, node->err.size);
         }
+        out_write(walker, node->out.data, node->out.size);
 
-        if (!opts.long_listing)
-                printf("\n");
+        int status = node->status;
+        for (size_t i = 0; i != node->n_children; i++) {
+                if (!opts.summarize)
+                        separate(walker);
 
-        rewinddir(dir);
+                int error = emit(walker, node->children[i], node);
+                if (error > status)
+                        status = error;
+        }
 
-        /**
-         * According to perf 'readdir' is not so efficient this way.
-         * Better way is to read once and then recursively travel.
-         *
-         * perf report:
-         *     15,36%  myls     libc.so.6             [.] readdir64
-         *     10,25%  myls     [unknown]             [k] 0xffffffffb5600191
-         *      8,77%  myls     libc.so.6             [.] _IO_file_xsputn
-         *
-         * But...
-         */
-        if (opts.recursive) {
-                while ((ent = readdir(dir))) {
+        /* Like 'du': every directory with -R, otherwise just the operand */
+        if (opts.summarize && (opts.recursive || !parent)) {
+                struct buf line = {0};
+                format_usage(&line, &node->usage, node->path);
+                out_write(walker, line.data, line.size);
+                buf_dtor(&line);
+        }
 
-                        if (!strcmp(ent->d_name, "." ) ||
-                            !strcmp(ent->d_name, ".."))
-                                continue;
+        if (opts.summarize && parent) {
+                parent->usage.blocks += node->usage.blocks;
+                parent->usage.bytes += node->usage.bytes;
+        }
 
-                        if (!opts.all && (*ent->d_name == '.'))
-                                continue;
+        buf_dtor(&node->out);
+        buf_dtor(&node->err);
+        free(node->children);
+        free(node->path);
+        free(node);
+        return status;
+}
 
-                        strncat(path, ent->d_name, PATH_MAX - 1);
-                        if (lstat(path, &ent_st) == -1) {
-                                path[path_len] = '\0';
-                                fprintf(stderr, "%s: %s\n", path, strerror(errno));
-                                continue;
-                        }
+int
+ls(struct walker *walker, const char *path)
+{
+        assert(path);
+
+        struct meta meta;
+        int error = lookup(AT_FDCWD, path, stat_mask() | STATX_TYPE | STATX_INO, &meta);
+        if (error) {
+                out_flush(walker);
+                fprintf(stderr, "%s: %s\n", path, strerror(error));
+                return TROUBLE;
+        }
 
-                        if (S_ISDIR(ent_st.st_mode))
-                                ls(path);
+        if (!opts.summarize)
+                separate(walker);
 
-                        path[path_len] = '\0';
-                }
+        if (!S_ISDIR(meta.mode) && opts.summarize) {
+                struct usage usage = {0};
+                usage_add(&usage, &meta);
+
+                struct buf out = {0};
+                format_usage(&out, &usage, path);
+                out_write(walker, out.data, out.size);
+                buf_dtor(&out);
+                return OK;
         }
 
-        closedir(dir);
-        return OK;
+        if (!S_ISDIR(meta.mode)) {
+                struct item item = { .name = path, .ino = meta.ino, .meta = meta };
+                struct widths widths;
+                measure(&item, 1, &widths);
+
+                struct buf out = {0};
+                format_item(&out, &item, &widths);
+                if (!opts.long_listing)
+                        buf_printf(&out, "\n");
+
+                out_write(walker, out.data, out.size);
+                buf_dtor(&out);
+                return OK;
+        }
+
+        struct node *root = node_ctor(path, NULL);
+        if (!root) {
+                out_flush(walker);
+                fprintf(stderr, "%s: %s\n", path, strerror(errno));
+                return TROUBLE;
+        }
+
+        /* The directory itself takes blocks too */
+        if (opts.summarize)
+                usage_add(&root->usage, &meta);
+
+        return emit(walker, root, NULL);
 }
 
 int
@@ -291,12 +2038,23 @@ main(int argc, char *argv[])
                 {"recursive",       no_argument, NULL, 'R'},
                 {"inode",           no_argument, NULL, 'i'},
                 {"numeric-uid-gid", no_argument, NULL, 'n'},
+                {"reverse",         no_argument, NULL, 'r'},
+                {"threads",   required_argument, NULL, 'j'},
+                {"uring",           no_argument, NULL, OPT_URING},
+                {"preload-names",   no_argument, NULL, OPT_PRELOAD},
+                {"summarize",       no_argument, NULL, OPT_SUMMARIZE},
                 { 0,                0,           0,     0 },
         };
 
+        long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        setlocale(LC_ALL, "");
+        const char *collate = setlocale(LC_COLLATE, NULL);
+        collate_bytes = !collate || !strcmp(collate, "C") || !strcmp(collate, "POSIX");
+
         int opt = 0;
         /* Aldrin -- a toxic synthetic insecticide, now generally banned :D */
-        while ((opt = getopt_long(argc, argv, "aldRin", options, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "aldRinj:fUtSvr", options, NULL)) != -1) {
 
                 switch(opt) {
                 case 'l':
@@ -317,6 +2075,37 @@ main(int argc, char *argv[])
                 case 'n':
                         opts.numeric_uid_gid = 1;
                         break;
+                case 'j':
+                        n_threads = atol(optarg);
+                        break;
+                /* Unsorted is the fastest path: 'getdents' order, no keys at all */
+                case 'f':
+                        opts.all = 1;
+                        /* fallthrough */
+                case 'U':
+                        opts.sort = SORT_NONE;
+                        break;
+                case 't':
+                        opts.sort = SORT_TIME;
+                        break;
+                case 'S':
+                        opts.sort = SORT_SIZE;
+                        break;
+                case 'v':
+                        opts.sort = SORT_VERSION;
+                        break;
+                case 'r':
+                        opts.reverse = 1;
+                        break;
+                case OPT_URING:
+                        opts.uring = 1;
+                        break;
+                case OPT_PRELOAD:
+                        opts.preload = 1;
+                        break;
+                case OPT_SUMMARIZE:
+                        opts.summarize = 1;
+                        break;
                 default:
                         break;
                 }
@@ -329,13 +2118,35 @@ main(int argc, char *argv[])
         if ((argc - optind) > 1)
                 opts.name_dir = 1;
 
-        char path[PATH_MAX] = {0};
+        /* Huge listings touch most of the ids anyway: read the files once */
+        if (opts.preload && opts.long_listing && !opts.numeric_uid_gid && !opts.summarize) {
+                preload(&users, "/etc/passwd");
+                preload(&groups, "/etc/group");
+        }
+
+        /* Disk usage counts everything and only needs the totals in order */
+        if (opts.summarize) {
+                opts.all = 1;
+                opts.sort = SORT_NONE;
+        }
+
+        /* Only recursive walks have anything to do in parallel */
+        if (!(opts.recursive || opts.summarize) || n_threads <= 1)
+                n_threads = 0;
+
+        struct walker walker;
+        if (walker_ctor(&walker, n_threads)) {
+                perror("ls");
+                return TROUBLE;
+        }
+
+        int status = OK;
         for (int i = optind; i < argc; i++) {
-                /* Make path null terminated */
-                strncpy(path, argv[i], sizeof(path) - 1);
-                ls(path);
+                int error = ls(&walker, argv[i]);
+                if (error > status)
+                        status = error;
         }
 
-        return 0;
+        walker_dtor(&walker);
+        return status;
 }
-
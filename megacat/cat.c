@@ -12,13 +12,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#ifdef HARD_DEBUG
-#define debug(...) \
-  do { fprintf(stderr, __VA_ARGS__); } while (0)
-#else
-#define debug(...) \
-  do { } while (0)
-#endif /* HARD_DEBUG */
+#include "../trace/trace.h"
 
 uint64_t
 check_sum(char *data, size_t size) {
@@ -76,8 +70,6 @@ int main(int argc,
     if (n_cats < 0)
         return fprintf(stderr, "Invalid number of cats"), EXIT_FAILURE;
 
-    debug("Cats number: %d\n", n_cats);
-
     struct command cmd = {
         .path = argv[1],
         .args = { argv[1], NULL},
@@ -134,10 +126,6 @@ int main(int argc,
     fds[0].fd = 0;
     fds[n_fds - 1].fd = 1;
 
-    for (int i = 0; i < n_fds; ++i) {
-        debug("fds[%d]: %d\n", i, fds[i].fd);
-    }
-
     struct buffer *bufs = calloc(n_cats + 1, sizeof(struct buffer));
     if (bufs == NULL)
         return perror_s("Buffers calloc failed"), EXIT_FAILURE;
@@ -165,7 +153,11 @@ int main(int argc,
             }
         }
 
+        TRACE_BEGIN("poll");
         int n_ready = poll(fds, n_fds, 500);
+        TRACE_END("poll");
+        TRACE_COUNTER("ready", n_ready);
+
         if (n_ready == -1)
             return perror_s("poll() failed"), EXIT_FAILURE;
 
@@ -173,25 +165,19 @@ int main(int argc,
             struct buffer *buf = &bufs[i / 2];
 
             if (fds[i].revents & POLLIN) {
-                debug("fd [%d] pollin \n", i);
                 ssize_t n_read = read(fds[i].fd, buf->data, 0x1000);
                 if (n_read == -1)
                     return perror_s("read failed"), EXIT_FAILURE;
 
-                debug("read to buffer[%d] %ld bytes\n", i/2, n_read);
+                TRACE_INSTANT("read", n_read);
                 buf->size = n_read;
                 buf->checksum += check_sum(buf->data, buf->size);
-                debug("buffer[%d] checksum %lu\n", i/2, buf->checksum);
             }
             else if (fds[i].revents & POLLOUT) {
-                debug("fd [%d] pollout\n", i);
                 ssize_t n_write = write(fds[i].fd, buf->data, buf->size);
                 if (n_write == -1)
                     return perror_s("write failed"), EXIT_FAILURE;
-                if (fds[i].fd == 1)
-                    debug("\n\n\n");
-
-                debug("write from buffer[%d] %ld bytes\n", i/2, buf->size);
+                TRACE_INSTANT("write", n_write);
 
                 /**
                  * TODO: Now we assume that write call will
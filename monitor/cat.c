@@ -8,11 +8,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
-#ifdef HARD_DEBUG
-#define $ fprintf(stderr, "%s: %d\n", __PRETTY_FUNCTION__, __LINE__);
-#else
-#define $
-#endif
+#include "../trace/trace.h"
 
 void perror_s(const char *msg)
 {
@@ -44,7 +40,7 @@ struct monitor {
 int
 mon_ctor(struct monitor *mon,
          size_t n_bufs)
-{$
+{
     assert(mon && n_bufs);
 
     pthread_mutex_init(&mon->mutex, NULL);
@@ -80,7 +76,7 @@ mon_ctor(struct monitor *mon,
 
 void
 mon_dtor(struct monitor *mon)
-{$
+{
     pthread_mutex_lock(&mon->mutex);
 
     free(mon->bufs);
@@ -102,11 +98,15 @@ mon_dtor(struct monitor *mon)
 
 struct buffer *
 mon_get_filled(struct monitor *mon)
-{$
+{
+    TRACE_SCOPE(__func__);
     pthread_mutex_lock(&mon->mutex);
 
-    if (mon->size == 0)
+    if (mon->size == 0) {
+        TRACE_BEGIN("wait not_empty");
         pthread_cond_wait(&mon->not_empty, &mon->mutex);
+        TRACE_END("wait not_empty");
+    }
 
     struct buffer *buf = mon->bufs + mon->tail;
 
@@ -116,11 +116,13 @@ mon_get_filled(struct monitor *mon)
 
 void
 mon_put_filled(struct monitor *mon)
-{$
+{
+    TRACE_SCOPE(__func__);
     pthread_mutex_lock(&mon->mutex);
 
     mon->head = (mon->head + 1) % mon->n_bufs;
     mon->size++;
+    TRACE_COUNTER("filled", mon->size);
 
     if (mon->size == 1)
         pthread_cond_signal(&mon->not_empty);
@@ -130,11 +132,15 @@ mon_put_filled(struct monitor *mon)
 
 struct buffer *
 mon_get_empty(struct monitor *mon)
-{$
+{
+    TRACE_SCOPE(__func__);
     pthread_mutex_lock(&mon->mutex);
 
-    if (mon->size == mon->n_bufs)
+    if (mon->size == mon->n_bufs) {
+        TRACE_BEGIN("wait not_filled");
         pthread_cond_wait(&mon->not_filled, &mon->mutex);
+        TRACE_END("wait not_filled");
+    }
 
     struct buffer *buf = mon->bufs + mon->head;
 
@@ -144,11 +150,13 @@ mon_get_empty(struct monitor *mon)
 
 void
 mon_put_empty(struct monitor *mon)
-{$
+{
+    TRACE_SCOPE(__func__);
     pthread_mutex_lock(&mon->mutex);
 
     mon->tail = (mon->tail + 1) % mon->n_bufs;
     mon->size--;
+    TRACE_COUNTER("filled", mon->size);
 
     if (mon->size == mon->n_bufs - 1)
         pthread_cond_signal(&mon->not_filled);
@@ -159,7 +167,7 @@ mon_put_empty(struct monitor *mon)
 int
 reader(struct monitor *mon,
        int fd)
-{$
+{
     size_t n_read = 0;
     do {
         struct buffer *buf = mon_get_empty(mon);
@@ -180,7 +188,7 @@ reader(struct monitor *mon,
 int
 writer(struct monitor *mon,
        int fd)
-{$
+{
     struct buffer *buf;
     do {
         buf = mon_get_filled(mon);
@@ -212,7 +220,8 @@ struct thread_args {
 
 void *
 load_writer(void *args_p)
-{$
+{
+    trace_thread("writer");
     struct thread_args *args = (struct thread_args *)args_p;
     writer(args->mon, args->fd);
     return NULL;
@@ -220,7 +229,8 @@ load_writer(void *args_p)
 
 void *
 load_reader(void *args_p)
-{$
+{
+    trace_thread("reader");
     struct thread_args *args = (struct thread_args *)args_p;
     reader(args->mon, args->fd);
     return NULL;
@@ -253,7 +263,7 @@ cat(struct monitor *mon, int fd)
 int
 main(int argc,
      const char *argv[])
-{$
+{
     struct monitor mon;
     mon_ctor(&mon, 0x10);
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -5,8 +6,14 @@
 #include <ctype.h>
 #include <assert.h>
 #include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 
 void perror_s(const char *msg)
 {
@@ -64,9 +71,22 @@ void *stack_extract(struct stack *stk)
     return (stk->elems = newbies);
 }
 
-struct command *split_input(char *buf, const size_t kinput_sz, size_t *n_cmds)
+/* Signal mask of the shell with SIGCHLD unblocked, set up in main() */
+static sigset_t prompt_mask;
+
+/**
+ * Split input line into pipeline commands.
+ * Trailing '&' is stripped and reported through 'background'.
+ *
+ * Note! SIGCHLD is blocked everywhere but in the wait for input here,
+ * so a child exiting either before or during that wait interrupts it.
+ * Then zero commands are returned, and the caller can reap finished
+ * jobs and reprint the prompt.
+ * End of input returns NULL with errno cleared.
+ */
+struct command *split_input(char *buf, const size_t kinput_sz, size_t *n_cmds, int *background)
 {
-    assert(buf && n_cmds);
+    assert(buf && n_cmds && background);
 
     struct stack tokens = {
         .size = 0,
@@ -76,12 +96,31 @@ struct command *split_input(char *buf, const size_t kinput_sz, size_t *n_cmds)
     };
 
     memset(buf, 0, kinput_sz);
-    ssize_t n_read = read(0, buf, kinput_sz);
-    if (n_read == -1)
+    struct pollfd input = { .fd = 0, .events = POLLIN };
+    int n_ready = ppoll(&input, 1, NULL, &prompt_mask);
+    if (n_ready == -1 && errno != EINTR)
         return perror("split"), free(tokens.elems), NULL;
+
+    ssize_t n_read = 0;
+    if (n_ready > 0) {
+        n_read = read(0, buf, kinput_sz);
+        if (n_read == 0)
+            return errno = 0, free(tokens.elems), NULL;
+        if (n_read == -1)
+            return perror("split"), free(tokens.elems), NULL;
+    }
     if (n_read == kinput_sz)
         return fprintf(stderr, "split: Buffer overflow\n"), free(tokens.elems), NULL;
 
+    *background = 0;
+    for (ssize_t i = n_read - 1; i >= 0 && (isspace(buf[i]) || buf[i] == '&'); --i) {
+        if (buf[i] == '&') {
+            buf[i] = ' ';
+            *background = 1;
+            break;
+        }
+    }
+
     char *token = strtok(buf, "|");
     while (token) {
         stack_push(&tokens, &token);
@@ -139,6 +178,210 @@ void free_cmds(struct command *cmds, size_t n_cmds)
     free(cmds);
 }
 
+/**
+ * Pipeline stage accounting.
+ * Filled by wait4() when the stage is reaped.
+ */
+struct stage {
+    pid_t pid;
+    char *path;
+    int alive;
+    int status;
+    struct rusage usage;
+    struct timespec end;
+};
+
+struct job {
+    size_t id;
+    int background;
+    size_t n_stages;
+    size_t n_alive;
+    struct stage *stages;
+    struct timespec start;
+};
+
+#define MAX_JOBS 0x40
+static struct job *jobs[MAX_JOBS];
+
+static struct {
+    int stats;
+} opts = {0};
+
+void job_dtor(struct job *job);
+
+struct job *job_ctor(struct command *cmds, size_t n_cmds, int background)
+{
+    assert(cmds && n_cmds);
+
+    struct job *job = calloc(1, sizeof(struct job));
+    if (!job)
+        return perror_s("job alloc failed"), NULL;
+
+    job->stages = calloc(n_cmds, sizeof(struct stage));
+    if (!job->stages)
+        return perror_s("job alloc failed"), free(job), NULL;
+
+    /* Background jobs outlive the input buffer, so own the names */
+    job->n_stages = n_cmds;
+    for (size_t i = 0; i != n_cmds; ++i) {
+        job->stages[i].path = strdup(cmds[i].path);
+        if (!job->stages[i].path)
+            return perror_s("job alloc failed"), job_dtor(job), NULL;
+    }
+
+    job->background = background;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    return job;
+}
+
+void job_dtor(struct job *job)
+{
+    if (!job)
+        return;
+
+    for (size_t i = 0; i != job->n_stages; ++i)
+        free(job->stages[i].path);
+
+    free(job->stages);
+    free(job);
+}
+
+/**
+ * Put background job into the jobs table.
+ * Returns:
+ *      returns 0 if table is full. Job id otherwise.
+ */
+size_t job_add(struct job *job)
+{
+    assert(job);
+
+    for (size_t i = 0; i != MAX_JOBS; ++i) {
+        if (!jobs[i]) {
+            jobs[i] = job;
+            return (job->id = i + 1);
+        }
+    }
+
+    return 0;
+}
+
+static struct stage *job_find(struct job *job, pid_t pid)
+{
+    if (!job)
+        return NULL;
+
+    for (size_t i = 0; i != job->n_stages; ++i)
+        if (job->stages[i].pid == pid && job->stages[i].alive)
+            return &job->stages[i];
+
+    return NULL;
+}
+
+static long ms(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+void job_report(const struct job *job)
+{
+    assert(job);
+
+    if (job->background)
+        fprintf(stderr, "[%zu] Done\t%s\n", job->id, job->stages[0].path);
+
+    if (!opts.stats)
+        return;
+
+    /* The stage which burnt most of CPU is the pipeline bottleneck */
+    size_t hot = 0;
+    long hot_cpu = -1;
+    for (size_t i = 0; i != job->n_stages; ++i) {
+        const struct rusage *ru = &job->stages[i].usage;
+        long cpu = ms(&ru->ru_utime) + ms(&ru->ru_stime);
+        if (cpu > hot_cpu)
+            hot = i, hot_cpu = cpu;
+    }
+
+    fprintf(stderr, "  # %7s %6s %9s %9s %9s %10s %7s %7s  %s\n",
+            "pid", "status", "real(ms)", "user(ms)", "sys(ms)",
+            "maxrss(KB)", "vcsw", "ivcsw", "command");
+
+    for (size_t i = 0; i != job->n_stages; ++i) {
+        const struct stage *stage = &job->stages[i];
+        const struct rusage *ru = &stage->usage;
+
+        long real = (stage->end.tv_sec  - job->start.tv_sec) * 1000 +
+                    (stage->end.tv_nsec - job->start.tv_nsec) / 1000000;
+
+        int status = WIFEXITED(stage->status) ? WEXITSTATUS(stage->status)
+                                              : 128 + WTERMSIG(stage->status);
+
+        fprintf(stderr, "%c%2zu %7d %6d %9ld %9ld %9ld %10ld %7ld %7ld  %s\n",
+                i == hot ? '*' : ' ', i, stage->pid, status, real,
+                ms(&ru->ru_utime), ms(&ru->ru_stime), ru->ru_maxrss,
+                ru->ru_nvcsw, ru->ru_nivcsw, stage->path);
+    }
+}
+
+/**
+ * Reap one child with wait4() and account it to its job.
+ * Foreground job is searched first, then the jobs table.
+ *
+ * Returns:
+ *      pid of reaped child, 0 if nothing to reap (WNOHANG),
+ *      -1 on error with errno set (ECHILD, EINTR).
+ */
+pid_t reap(struct job *fg, int options)
+{
+    int status = 0;
+    struct rusage usage;
+
+    pid_t pid = wait4(-1, &status, options, &usage);
+    if (pid <= 0)
+        return pid;
+
+    struct job *job = fg;
+    struct stage *stage = job_find(fg, pid);
+    for (size_t i = 0; !stage && i != MAX_JOBS; ++i)
+        stage = job_find(job = jobs[i], pid);
+
+    /* Some orphan, e.g. stage failed before it was accounted */
+    if (!stage)
+        return pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &stage->end);
+    stage->status = status;
+    stage->usage = usage;
+    stage->alive = 0;
+    job->n_alive--;
+    return pid;
+}
+
+/**
+ * Collect all finished background jobs without blocking.
+ */
+void reap_jobs()
+{
+    while (reap(NULL, WNOHANG) > 0)
+    {}
+
+    for (size_t i = 0; i != MAX_JOBS; ++i) {
+        if (jobs[i] && jobs[i]->n_alive == 0) {
+            job_report(jobs[i]);
+            job_dtor(jobs[i]);
+            jobs[i] = NULL;
+        }
+    }
+}
+
+/**
+ * SIGCHLD only has to interrupt the wait for input at the prompt.
+ * Actual reaping is done synchronously in reap_jobs().
+ */
+void handler_chld(int signo)
+{
+}
+
 void invite()
 {
     fprintf(stderr, "shell> ");
@@ -149,10 +392,45 @@ int main(int argc, char *argv[])
     const size_t kinput_sz = 0xff;
     char buf[kinput_sz];
 
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's':
+            opts.stats = 1;
+            break;
+        default:
+            return fprintf(stderr, "usage: %s [-s]\n", argv[0]), EXIT_FAILURE;
+        }
+    }
+
+    /* No SA_RESTART: we want read() at the prompt to be interrupted */
+    struct sigaction sa;
+    sa.sa_handler = handler_chld;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGCHLD, &sa, NULL) != 0)
+        return perror_s("sigaction failed"), EXIT_FAILURE;
+
+    /**
+     * Keep SIGCHLD pending until the prompt waits in ppoll(), otherwise
+     * one arriving between reap_jobs() and the wait would be lost.
+     */
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld, &prompt_mask) != 0)
+        return perror_s("sigprocmask failed"), EXIT_FAILURE;
+    sigdelset(&prompt_mask, SIGCHLD);
+
     for (;;) {
+        reap_jobs();
         invite();
         size_t n_cmds = 0;
-        struct command *cmds = (struct command *)split_input(buf, kinput_sz, &n_cmds);
+        int background = 0;
+        struct command *cmds = (struct command *)split_input(buf, kinput_sz, &n_cmds, &background);
+        if (!cmds && errno == 0)
+            break;
         if (!cmds)
             return fprintf(stderr, "split failed\n"), EXIT_FAILURE;
 
@@ -190,9 +468,31 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        struct job *job = job_ctor(cmds, n_cmds, background);
+        if (!job)
+            return free(pipes), free_cmds(cmds, n_cmds), EXIT_FAILURE;
+
+        int forked = 1;
         for (size_t i = 0; i < n_cmds; i++) {
             pid_t pid = fork();
+            if (pid == -1) {
+                perror_s("fork failed");
+                forked = 0;
+                break;
+            }
+
             if (pid == 0) {
+                /* The mask survives exec, the child must see SIGCHLD */
+                sigprocmask(SIG_SETMASK, &prompt_mask, NULL);
+
+                /* Background job must not steal the terminal input */
+                if (i == 0 && background) {
+                    int null_fd = open("/dev/null", O_RDONLY);
+                    if (null_fd == -1 || dup2(null_fd, 0) == -1)
+                        return perror_s("background stdin"), errno;
+                    close(null_fd);
+                }
+
                 /* Redirect stdin to the prev read */
                 if (i != 0) {
                     if (dup2(pipes[i - 1][0], 0) == -1)
@@ -215,16 +515,46 @@ int main(int argc, char *argv[])
                 free(pipes);
                 return ENOENT;
             }
+
+            job->stages[i].pid = pid;
+            job->stages[i].alive = 1;
+            job->n_alive++;
         }
 
         /* Close other pipes in grandpa */
         for (size_t j = 0; j != n_pipes; ++j)
             close(pipes[j][0]), close(pipes[j][1]);
 
-        int status = 0;
-        for (size_t i = 0; i != n_cmds; ++i) {
-            wait(&status);
-            status = WEXITSTATUS(status);
+        /* Stages already started are waited for, but it is no job to report */
+        if (!forked)
+            job->background = 0;
+
+        if (job->background) {
+            size_t id = job_add(job);
+            if (id) {
+                fprintf(stderr, "[%zu] %d\n", id, job->stages[n_cmds - 1].pid);
+            } else {
+                /* Jobs table is full, fall back to foreground */
+                fprintf(stderr, "Too many jobs, waiting in foreground\n");
+                job->background = 0;
+            }
+        }
+
+        /**
+         * Stages may finish in any order. Reap whoever is done first,
+         * background jobs included, so every stage gets exact rusage.
+         */
+        while (!job->background && job->n_alive) {
+            if (reap(job, 0) == -1 && errno != EINTR) {
+                perror_s("wait4 failed");
+                break;
+            }
+        }
+
+        if (!job->background) {
+            if (forked)
+                job_report(job);
+            job_dtor(job);
         }
 
         free_cmds(cmds, n_cmds);
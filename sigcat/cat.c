@@ -1,8 +1,19 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
 
 #define $ fprintf(stderr, "%s: %d\n", __PRETTY_FUNCTION__, __LINE__);
 
@@ -16,6 +27,25 @@ void perror_s(const char *msg)
     errno = saved_errno;
 }
 
+static int
+write_all(int fd, const void *data, size_t size)
+{
+    const char *ptr = data;
+    while (size) {
+        ssize_t n_written = write(fd, ptr, size);
+        if (n_written == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        ptr += n_written;
+        size -= n_written;
+    }
+
+    return 0;
+}
+
 volatile sig_atomic_t bit;
 
 void
@@ -49,10 +79,12 @@ writer(pid_t pid,
         for (size_t k = 0; k != 8; k++) {
             sigsuspend(&empty_set);
             byte |= ((unsigned char)bit << k);
+
+            /* Before the last ack: the reader kills us right after it */
+            if (k == 7)
+                write(fd, &byte, 1);
             kill(pid, SIG0);
         }
-
-        write(fd, &byte, 1);
     }
 
     return 0;
@@ -81,13 +113,13 @@ reader(pid_t pid,
         return perror_s("sigaction failed"), errno;
 
     static char buf[0xff];
-    size_t n_read = 0;
+    ssize_t n_read = 0;
     do {
         n_read = read(fd, buf, sizeof(buf));
         if (n_read == -1)
             return perror_s("cat read failed"), errno;
 
-        for (size_t i = 0; i != n_read; i++) {
+        for (ssize_t i = 0; i != n_read; i++) {
             unsigned char byte = buf[i];
             for (size_t k = 0; k != 8; k++) {
                 if (byte >> k & 1)
@@ -101,11 +133,421 @@ reader(pid_t pid,
     }
     while (n_read != 0);
 
+    /* Bit writer never finishes on its own */
+    kill(pid, SIGTERM);
+    return 0;
+}
+
+/**
+ * Signals may carry a value: with SA_SIGINFO the handler
+ * gets 'si_value' sent by sigqueue(), a whole pointer-sized
+ * word per signal instead of one bit.
+ */
+volatile sig_atomic_t last_signo;
+volatile uint64_t last_value;
+
+void
+handler_info(int signo, siginfo_t *info, void *context)
+{
+    last_signo = signo;
+    last_value = (uintptr_t)info->si_value.sival_ptr;
+}
+
+static int
+set_handlers(void (*action)(int, siginfo_t *, void *))
+{
+    struct sigaction sa;
+    sa.sa_sigaction = action;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIG0, &sa, NULL) != 0)
+        return perror_s("sigaction failed"), errno;
+    if (sigaction(SIG1, &sa, NULL) != 0)
+        return perror_s("sigaction failed"), errno;
+
     return 0;
 }
 
+static int
+send_value(pid_t pid, int signo, uint64_t value)
+{
+    union sigval sv;
+    sv.sival_ptr = (void *)(uintptr_t)value;
+
+    while (sigqueue(pid, signo, sv) == -1) {
+        if (errno != EAGAIN)
+            return perror_s("sigqueue failed"), errno;
+    }
+
+    return 0;
+}
+
+/**
+ * Word protocol:
+ *      SIG0 carries 8 bytes of data,
+ *      SIG1 carries the tail: up to 7 bytes and their count
+ *           in the last byte, and ends the transfer.
+ * Every signal is acknowledged by SIG0 back.
+ */
+#define WORD sizeof(uint64_t)
+#define WORD_BUF 0x1000
+
 int
-cat(int fd)
+word_writer(pid_t pid,
+            int fd)
+{$
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+
+    if (set_handlers(handler_info))
+        return errno;
+
+    static unsigned char buf[WORD_BUF];
+    size_t size = 0;
+
+    for (;;) {
+        sigsuspend(&empty_set);
+
+        uint64_t value = last_value;
+        unsigned char *word = (unsigned char *)&value;
+        size_t len = last_signo == SIG1 ? word[WORD - 1] : WORD;
+
+        memcpy(buf + size, word, len);
+        size += len;
+
+        if (size + WORD > sizeof(buf) || last_signo == SIG1) {
+            if (write_all(fd, buf, size))
+                return perror_s("cat write failed"), errno;
+            size = 0;
+        }
+
+        /* Ack after the write: the reader exits on the last one */
+        int done = last_signo == SIG1;
+        kill(pid, SIG0);
+        if (done)
+            return 0;
+    }
+}
+
+int
+word_reader(pid_t pid,
+            int fd)
+{$
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+
+    if (set_handlers(handler_info))
+        return errno;
+
+    static unsigned char buf[0x10000];
+    size_t carry = 0;
+
+    for (;;) {
+        ssize_t n_read = read(fd, buf + carry, sizeof(buf) - carry);
+        if (n_read == -1)
+            return perror_s("cat read failed"), errno;
+
+        size_t size = carry + n_read;
+        size_t i = 0;
+        for (; i + WORD <= size; i += WORD) {
+            uint64_t value;
+            memcpy(&value, buf + i, WORD);
+            if (send_value(pid, SIG0, value))
+                return errno;
+
+            sigsuspend(&empty_set);
+        }
+
+        carry = size - i;
+        memmove(buf, buf + i, carry);
+
+        if (n_read == 0)
+            break;
+    }
+
+    uint64_t value = 0;
+    unsigned char *word = (unsigned char *)&value;
+    memcpy(word, buf, carry);
+    word[WORD - 1] = carry;
+
+    if (send_value(pid, SIG1, value))
+        return errno;
+
+    sigsuspend(&empty_set);
+    return 0;
+}
+
+/**
+ * Doorbell protocol: data goes through two slots of a shared
+ * mapping, the reader fills one while the writer drains the other.
+ * Signals only say which slot is ready and how much is in it
+ * (len << 1 | slot): SIG0 for data, SIG1 with len 0 at the end.
+ * At most one doorbell and one ack are ever in flight, so plain
+ * signals cannot coalesce.
+ */
+#define SHM_SLOT 0x100000
+
+static char (*shm)[SHM_SLOT];
+
+int
+shm_writer(pid_t pid,
+           int fd)
+{$
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+
+    if (set_handlers(handler_info))
+        return errno;
+
+    for (;;) {
+        sigsuspend(&empty_set);
+
+        uint64_t value = last_value;
+        size_t len = value >> 1;
+        size_t slot = value & 1;
+        if (len && write_all(fd, shm[slot], len))
+            return perror_s("cat write failed"), errno;
+
+        int done = last_signo == SIG1;
+        kill(pid, SIG0);
+        if (done)
+            return 0;
+    }
+}
+
+int
+shm_reader(pid_t pid,
+           int fd)
+{$
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+
+    if (set_handlers(handler_info))
+        return errno;
+
+    size_t slot = 0;
+    int in_flight = 0;
+
+    for (;;) {
+        ssize_t n_read = read(fd, shm[slot], SHM_SLOT);
+        if (n_read == -1)
+            return perror_s("cat read failed"), errno;
+
+        /* The other slot must be drained before we ring again */
+        if (in_flight)
+            sigsuspend(&empty_set);
+
+        if (send_value(pid, n_read ? SIG0 : SIG1, (uint64_t)n_read << 1 | slot))
+            return errno;
+        in_flight = 1;
+
+        if (n_read == 0)
+            break;
+        slot ^= 1;
+    }
+
+    sigsuspend(&empty_set);
+    return 0;
+}
+
+/**
+ * Windowed protocol on realtime signals: unlike SIGUSR1/2 they
+ * queue instead of coalescing, so many words may be in flight.
+ *
+ *      SIG_DATA carries 8 bytes, SIG_END the tail like SIG1 above,
+ *      SIG_ACK  tells the sender how many units were consumed.
+ *
+ * The sender keeps up to 'window' units unacknowledged. The receiver
+ * does not take signals one by one in a handler: it reads them in
+ * batches from a signalfd whenever epoll says it is readable, and
+ * acknowledges every half window at once.
+ */
+#define SIG_DATA (SIGRTMIN)
+#define SIG_END  (SIGRTMIN + 1)
+#define SIG_ACK  (SIGRTMIN + 2)
+
+static size_t window = 0x100;
+
+int
+rt_writer(pid_t pid,
+          int fd)
+{$
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIG_DATA);
+    sigaddset(&set, SIG_END);
+
+    int sig_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1)
+        return perror_s("signalfd"), errno;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        return perror_s("epoll_create1"), errno;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = sig_fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &event))
+        return perror_s("epoll_ctl"), errno;
+
+    static struct signalfd_siginfo infos[0x40];
+    static unsigned char buf[0x10000];
+    size_t size = 0;
+
+    size_t batch = window / 2 ? window / 2 : 1;
+    size_t unacked = 0;
+    int done = 0;
+
+    while (!done) {
+        if (epoll_wait(epoll_fd, &event, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            return perror_s("epoll_wait"), errno;
+        }
+
+        for (;;) {
+            ssize_t n_read = read(sig_fd, infos, sizeof(infos));
+            if (n_read == -1) {
+                if (errno == EAGAIN)
+                    break;
+                return perror_s("signalfd read"), errno;
+            }
+
+            for (size_t i = 0; i != n_read / sizeof(infos[0]); i++) {
+                uint64_t value = infos[i].ssi_ptr;
+                unsigned char *word = (unsigned char *)&value;
+                int last = (int)infos[i].ssi_signo == SIG_END;
+                size_t len = last ? word[WORD - 1] : WORD;
+
+                memcpy(buf + size, word, len);
+                size += len;
+                unacked++;
+                done |= last;
+
+                if (size + WORD > sizeof(buf) || last) {
+                    if (write_all(fd, buf, size))
+                        return perror_s("cat write failed"), errno;
+                    size = 0;
+                }
+            }
+
+            if (unacked >= batch || done) {
+                if (send_value(pid, SIG_ACK, unacked))
+                    return errno;
+                unacked = 0;
+            }
+        }
+    }
+
+    close(epoll_fd);
+    close(sig_fd);
+    return 0;
+}
+
+/**
+ * Returns:
+ *      number of units the receiver has acknowledged.
+ */
+static size_t
+wait_ack(const sigset_t *ack_set)
+{
+    siginfo_t info;
+    while (sigwaitinfo(ack_set, &info) == -1)
+        if (errno != EINTR)
+            return perror_s("sigwaitinfo"), 0;
+
+    return (uintptr_t)info.si_value.sival_ptr;
+}
+
+/**
+ * Returns:
+ *      0 on success, errno otherwise. Waits for acks while the
+ *      window is full or the kernel queue (RLIMIT_SIGPENDING) is.
+ */
+static int
+rt_send(pid_t pid, int signo, uint64_t value, size_t *in_flight, const sigset_t *ack_set)
+{
+    while (*in_flight >= window)
+        *in_flight -= wait_ack(ack_set);
+
+    union sigval sv;
+    sv.sival_ptr = (void *)(uintptr_t)value;
+    while (sigqueue(pid, signo, sv) == -1) {
+        if (errno != EAGAIN || !*in_flight)
+            return perror_s("sigqueue failed"), errno;
+        *in_flight -= wait_ack(ack_set);
+    }
+
+    (*in_flight)++;
+    return 0;
+}
+
+int
+rt_reader(pid_t pid,
+          int fd)
+{$
+    sigset_t ack_set;
+    sigemptyset(&ack_set);
+    sigaddset(&ack_set, SIG_ACK);
+
+    static unsigned char buf[0x10000];
+    size_t carry = 0;
+    size_t in_flight = 0;
+
+    for (;;) {
+        ssize_t n_read = read(fd, buf + carry, sizeof(buf) - carry);
+        if (n_read == -1)
+            return perror_s("cat read failed"), errno;
+
+        size_t size = carry + n_read;
+        size_t i = 0;
+        for (; i + WORD <= size; i += WORD) {
+            uint64_t value;
+            memcpy(&value, buf + i, WORD);
+            if (rt_send(pid, SIG_DATA, value, &in_flight, &ack_set))
+                return errno;
+        }
+
+        carry = size - i;
+        memmove(buf, buf + i, carry);
+
+        if (n_read == 0)
+            break;
+    }
+
+    uint64_t value = 0;
+    unsigned char *word = (unsigned char *)&value;
+    memcpy(word, buf, carry);
+    word[WORD - 1] = carry;
+
+    if (rt_send(pid, SIG_END, value, &in_flight, &ack_set))
+        return errno;
+
+    while (in_flight)
+        in_flight -= wait_ack(&ack_set);
+
+    return 0;
+}
+
+struct transport {
+    const char *name;
+    int (*reader)(pid_t pid, int fd);
+    int (*writer)(pid_t pid, int fd);
+};
+
+static const struct transport transports[] = {
+    {"bit",  reader,      writer},
+    {"word", word_reader, word_writer},
+    {"shm",  shm_reader,  shm_writer},
+    {"rt",   rt_reader,   rt_writer},
+};
+
+#define N_TRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+
+int
+cat(int fd,
+    int out_fd,
+    const struct transport *transport)
 {$
     /* Block both signals in parent */
     sigset_t block_set, old_set;
@@ -113,43 +555,158 @@ cat(int fd)
     sigemptyset(&block_set);
     sigaddset(&block_set, SIGUSR1);
     sigaddset(&block_set, SIGUSR2);
+    sigaddset(&block_set, SIG_DATA);
+    sigaddset(&block_set, SIG_END);
+    sigaddset(&block_set, SIG_ACK);
 
     if (sigprocmask(SIG_BLOCK, &block_set, &old_set))
         return perror_s("sigprocmask"), errno;
 
+    /* Mapped before fork: both sides see the same pages */
+    if (transport->reader == shm_reader && !shm) {
+        shm = mmap(NULL, 2 * SHM_SLOT, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shm == MAP_FAILED) {
+            shm = NULL;
+            return perror_s("mmap"), errno;
+        }
+    }
+
     pid_t mypid = getpid();
     fprintf(stderr, "pid %d\n", mypid);
     pid_t pid = fork();
+    if (pid == -1)
+        return perror_s("fork"), errno;
     if (pid == 0)
-        return writer(mypid, 1);
+        _exit(transport->writer(mypid, out_fd));
 
-    reader(pid, fd);
-    kill(pid, SIGTERM);
+    int error = transport->reader(pid, fd);
+    if (error)
+        kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
 
     /* Restore old block mask */
-    if (sigprocmask(SIG_BLOCK, &old_set, NULL))
+    if (sigprocmask(SIG_SETMASK, &old_set, NULL))
         return perror_s("sigprocmask"), errno;
 
+    return error;
+}
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Push the same 'size' bytes through every transport into /dev/null.
+ */
+int
+benchmark(size_t size)
+{$
+    int fd = memfd_create("sigcat", 0);
+    if (fd == -1)
+        return perror_s("memfd_create"), errno;
+
+    static unsigned char block[0x1000];
+    for (size_t i = 0; i != sizeof(block); i++)
+        block[i] = i * 131 + (i >> 3);
+
+    for (size_t done = 0; done < size; done += sizeof(block)) {
+        size_t len = size - done < sizeof(block) ? size - done : sizeof(block);
+        if (write_all(fd, block, len))
+            return perror_s("benchmark"), errno;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1)
+        return perror_s("/dev/null"), errno;
+
+    size_t max_window = window;
+    for (size_t i = 0; i != N_TRANSPORTS; i++) {
+        /* Windowed transport: throughput as the window grows */
+        int windowed = transports[i].reader == rt_reader;
+        for (window = windowed ? 1 : max_window; window <= max_window; window <<= 1) {
+            lseek(fd, 0, SEEK_SET);
+
+            double start = now();
+            if (cat(fd, null_fd, &transports[i]))
+                break;
+            double elapsed = now() - start;
+
+            fprintf(stderr, "%-4s", transports[i].name);
+            if (windowed)
+                fprintf(stderr, " window %5zu", window);
+            fprintf(stderr, " %10zu bytes %10.3f s %14.0f B/s\n", size, elapsed, size / elapsed);
+        }
+    }
+    window = max_window;
+
+    close(null_fd);
+    close(fd);
     return 0;
 }
 
 int
 main(int argc,
-     const char *argv[])
+     char *argv[])
 {$
+    const struct transport *transport = &transports[0];
+    size_t bench_size = 0;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "m:b:w:")) != -1) {
+        switch (opt) {
+        case 'm':
+            transport = NULL;
+            for (size_t i = 0; i != N_TRANSPORTS; i++)
+                if (!strcmp(optarg, transports[i].name))
+                    transport = &transports[i];
+
+            if (!transport) {
+                fprintf(stderr, "unknown mode '%s': bit, word, shm or rt\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            bench_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m bit|word|shm|rt] [-w window] [-b bytes] [files...]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Both directions share the per-user queue of pending signals */
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_SIGPENDING, &limit) && limit.rlim_cur != RLIM_INFINITY &&
+        window > limit.rlim_cur / 2)
+        window = limit.rlim_cur / 2;
+    if (!window)
+        window = 1;
+
+    if (bench_size)
+        return benchmark(bench_size);
+
     printf("Hello world\n");
+    fflush(stdout);
 
-    if (argc == 1) {
-        cat(0);
+    if (optind == argc) {
+        cat(0, 1, transport);
     } else {
-        for (int i = 1; i < argc; i++) {
+        for (int i = optind; i < argc; i++) {
             int fd = open(argv[i], O_RDONLY);
             if (fd == -1) {
                 perror_s("cat");
                 continue;
             }
 
-            cat(fd);
+            cat(fd, 1, transport);
             close(fd);
         }
     }
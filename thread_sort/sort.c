@@ -8,12 +8,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
-#define HARD_DEBUG
-#ifdef HARD_DEBUG
-#define $ fprintf(stderr, "%s: %d\n", __PRETTY_FUNCTION__, __LINE__);
-#else
-#define $
-#endif
+#include "../trace/trace.h"
 
 void perror_s(const char *msg)
 {
@@ -47,8 +42,12 @@ struct pack_t {
 
 void *
 load_thread(void *args_p)
-{$
+{
+    trace_thread("sorter");
     struct pack_t *args = (struct pack_t *)args_p;
+
+    TRACE_SCOPE("sort pack");
+    TRACE_COUNTER("pack size", args->size);
     sort(args->data, args->size);
     return NULL;
 }
@@ -57,15 +56,18 @@ void
 dump_data(int *data,
           size_t count)
 {
+#ifdef HARD_DEBUG
     for (size_t j = 0; j < count; j++)
         fprintf(stderr, "%d ", data[j]);
     fprintf(stderr, "\n");
+#endif
 }
 
 int
 main(int argc,
      const char *argv[])
-{$
+{
+    trace_thread("main");
     if (argc != 3)
         return fprintf(stderr, "Invalid arguments count\n"), EXIT_FAILURE;
 
@@ -84,8 +86,10 @@ main(int argc,
     if (data == NULL)
         return fprintf(stderr, "Calloc failed\n"), EXIT_FAILURE;
 
+    TRACE_BEGIN("generate");
     for (size_t i = 0; i < count; i++)
         data[i] = rand() % 20;
+    TRACE_END("generate");
 
     size_t pack_sz = count / n_threads;
     size_t last_pack_sz = count % n_threads;
@@ -109,6 +113,7 @@ main(int argc,
     if (packs == NULL)
         return fprintf(stderr, "Calloc failed\n"), EXIT_FAILURE;
 
+    TRACE_BEGIN("sort");
     for (int i = 0; i < n_threads; i++) {
         packs[i].data = data + i * pack_sz;
         packs[i].size = pack_sz;
@@ -122,6 +127,7 @@ main(int argc,
     void *ret = NULL;
     for (int i = 0; i < n_threads; i++)
         pthread_join(tids[i], &ret);
+    TRACE_END("sort");
 
     dump_data(data, count);
 
@@ -132,6 +138,7 @@ main(int argc,
     if (new_data == NULL)
         fprintf(stderr, "Calloc failed\n");
 
+    TRACE_BEGIN("merge");
     for (size_t i = 0; i < count; i++) {
         size_t min_idx = 0;
         for (size_t j = 0; j < n_threads; j++) {
@@ -148,16 +155,19 @@ main(int argc,
         packs[min_idx].data++;
         packs[min_idx].size--;
     }
+    TRACE_END("merge");
 
     dump_data(data, count);
     dump_data(new_data, count);
 
+    TRACE_BEGIN("verify");
     qsort(data, count, sizeof(int), compare_ints);
     dump_data(data, count);
 
     for (size_t i = 0; i < count; i++) {
         if (data[i] != new_data[i]) {
             fprintf(stderr, "FAIL\n");
+            TRACE_END("verify");
             free(tids);
             free(packs);
             free(new_data);
@@ -165,6 +175,7 @@ main(int argc,
             return EXIT_FAILURE;
         }
     }
+    TRACE_END("verify");
 
     free(tids);
     free(packs);
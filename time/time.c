@@ -1,40 +1,807 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sched.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
 
-int
-main(int argc, char *argv[])
+struct {
+        unsigned json : 1;
+        unsigned counters : 1;
+        unsigned outliers : 1;
+        size_t n_runs;
+        size_t n_warmup;
+        FILE *out;
+} opts = {0};
+
+/**
+ * Hardware counters, one fd each. They are opened on ourselves
+ * disabled, with 'inherit' and 'enable_on_exec': the forked child
+ * gets its own copies, which start counting at exec, and their
+ * totals are folded back into our fds when it exits.
+ *
+ * No PERF_FORMAT_GROUP: it does not mix with 'inherit'.
+ */
+struct counter {
+        const char *name;
+        uint32_t type;
+        uint64_t config;
+        int fd;
+        uint64_t value;
+        /* Less than 1 if the kernel had to multiplex */
+        double running;
+};
+
+#define COUNTER(name_, config_) \
+        {.name = name_, .type = PERF_TYPE_HARDWARE, .config = config_, .fd = -1}
+
+static struct counter counters[] = {
+        COUNTER("cycles",        PERF_COUNT_HW_CPU_CYCLES),
+        COUNTER("instructions",  PERF_COUNT_HW_INSTRUCTIONS),
+        COUNTER("cache-misses",  PERF_COUNT_HW_CACHE_MISSES),
+        COUNTER("branch-misses", PERF_COUNT_HW_BRANCH_MISSES),
+};
+
+#define N_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static int
+perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+        return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+/**
+ * Returns:
+ *      number of counters opened. Unprivileged users often may
+ *      count user space only, so kernel is excluded on EACCES.
+ */
+size_t
+counters_open()
+{
+        size_t n_opened = 0;
+        for (size_t i = 0; i != N_COUNTERS; i++) {
+                struct perf_event_attr attr = {0};
+                attr.size = sizeof(attr);
+                attr.type = counters[i].type;
+                attr.config = counters[i].config;
+                attr.disabled = 1;
+                attr.inherit = 1;
+                attr.enable_on_exec = 1;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                int fd = perf_event_open(&attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+                if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+                        attr.exclude_kernel = 1;
+                        attr.exclude_hv = 1;
+                        fd = perf_event_open(&attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+                }
+
+                counters[i].fd = fd;
+                if (fd != -1)
+                        n_opened++;
+        }
+
+        return n_opened;
+}
+
+void
+counters_read()
 {
-        memmove(argv, argv + 1, sizeof(char *) * argc);
+        for (size_t i = 0; i != N_COUNTERS; i++) {
+                struct counter *counter = &counters[i];
+                if (counter->fd == -1)
+                        continue;
 
-        struct timeval start = {0};
-        gettimeofday(&start, NULL);
+                /* value, time enabled, time running */
+                uint64_t data[3] = {0};
+                if (read(counter->fd, data, sizeof(data)) != sizeof(data)) {
+                        close(counter->fd);
+                        counter->fd = -1;
+                        continue;
+                }
+
+                counter->running = data[1] ? (double)data[2] / data[1] : 0;
+                counter->value = counter->running ? data[0] / counter->running : 0;
+        }
+}
+
+/* Drop what warmup runs (or the previous command) have counted */
+void
+counters_reset()
+{
+        for (size_t i = 0; i != N_COUNTERS; i++)
+                if (counters[i].fd != -1)
+                        ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+}
 
-        pid_t pid = fork();
-        if (pid == 0) {
-                execvp(*argv, argv);
-                perror("");
-                return ENOENT;
+void
+counters_close()
+{
+        for (size_t i = 0; i != N_COUNTERS; i++) {
+                if (counters[i].fd != -1)
+                        close(counters[i].fd);
+                counters[i].fd = -1;
         }
+}
+
+/**
+ * Everything we know about one run of the command.
+ * Real time is split into phases:
+ *      fork: until the child runs its first instruction,
+ *      exec: until execve() has replaced the child image,
+ *      run:  from there until the child is reaped, which
+ *            includes dynamic linking before main().
+ */
+struct profile {
+        int status;
+        uint64_t real_ns;
+        uint64_t fork_ns;
+        uint64_t exec_ns;
+        uint64_t run_ns;
+        struct rusage usage;
+};
+
+static uint64_t
+now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+tv_us(const struct timeval *tv)
+{
+        return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+ * The child is started with clone(CLONE_VM | CLONE_VFORK): no page
+ * tables are copied, and we are suspended until it has exec'ed or
+ * died, so we wake up at the very instant exec succeeds. It shares
+ * our memory until then and stamps its own start time here.
+ *
+ * If exec fails the child reports errno through a close-on-exec
+ * pipe: an empty pipe means exec went through.
+ *
+ * On a single busy CPU the woken parent may only get to run after
+ * the command, then 'exec' includes its run time too.
+ */
+#define SPAWN_STACK 0x10000
+
+struct spawn {
+        char **argv;
+        int marker;
+        volatile uint64_t started;
+};
+
+static int
+spawn_child(void *spawn_p)
+{
+        struct spawn *spawn = (struct spawn *)spawn_p;
+        spawn->started = now_ns();
+
+        /* No command: just the cost of spawning */
+        if (!spawn->argv)
+                _exit(0);
+
+        execvp(*spawn->argv, spawn->argv);
+
+        int error = errno;
+        if (write(spawn->marker, &error, sizeof(error)) != sizeof(error))
+                error = ENOEXEC;
+        _exit(127);
+}
+
+/**
+ * Returns:
+ *      pid of the child, -1 with errno set if it could not be
+ *      started or could not exec (it is reaped then).
+ */
+pid_t
+spawn(char *argv[], struct profile *profile)
+{
+        static char stack[SPAWN_STACK] __attribute__((aligned(16)));
+
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1)
+                return -1;
+
+        struct spawn args = {.argv = argv, .marker = fds[1]};
 
+        uint64_t start = now_ns();
+        pid_t pid = clone(spawn_child, stack + sizeof(stack), CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+        uint64_t execed = now_ns();
+
+        int saved_errno = errno;
+        close(fds[1]);
+        if (pid == -1) {
+                close(fds[0]);
+                errno = saved_errno;
+                return -1;
+        }
+
+        int error = 0;
+        ssize_t n_read = read(fds[0], &error, sizeof(error));
+        close(fds[0]);
+
+        if (n_read > 0) {
+                while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+                        ;
+                errno = error;
+                return -1;
+        }
+
+        profile->fork_ns = args.started - start;
+        profile->exec_ns = execed - args.started;
+        return pid;
+}
+
+/**
+ * Returns:
+ *      0 on success (whatever the command exit status is),
+ *      errno if it could not be started or waited for.
+ */
+int
+run(char *argv[], struct profile *profile)
+{
+        uint64_t start = now_ns();
+
+        pid_t pid = spawn(argv, profile);
+        if (pid == -1)
+                return errno;
+
+        uint64_t execed = now_ns();
+
+        /* wait4 gives the child's resources alone, not of all our children */
         int status = 0;
-        wait(&status);
+        while (wait4(pid, &status, 0, &profile->usage) == -1)
+                if (errno != EINTR)
+                        return errno;
 
-        status = WEXITSTATUS(status);
-        if (status == ENOENT)
-                return status;
+        uint64_t end = now_ns();
+        profile->real_ns = end - start;
+        profile->run_ns = end - execed;
+        profile->status = status;
+        return 0;
+}
 
-        struct timeval end = {0};
-        gettimeofday(&end, NULL);
+/**
+ * Summary of a sample, like 'perf stat -r' prints.
+ */
+struct stats {
+        size_t n;
+        double mean;
+        double median;
+        double stddev;
+        double min;
+        double max;
+        /* Half-width of the 95% confidence interval of the mean */
+        double ci;
+};
 
-        struct timeval elapsed = {0};
-        timersub(&end, &start, &elapsed);
+/**
+ * Two-sided 95% quantiles of Student's t for 1..30 degrees
+ * of freedom, the normal one is close enough above.
+ */
+static double
+t_quantile(double df)
+{
+        static const double table[] = {
+                12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+        };
 
-        fprintf(stderr, "Elapsed time: %ld usec\n", elapsed.tv_sec * 1000000 + elapsed.tv_usec);
+        if (df < 1)
+                return table[0];
+        if (df <= 30)
+                return table[(size_t)df - 1];
+        if (df <= 60)
+                return 2.000;
+        if (df <= 120)
+                return 1.980;
+        return 1.960;
+}
+
+static int
+cmp_doubles(const void *lhs_p, const void *rhs_p)
+{
+        double lhs = *(const double *)lhs_p;
+        double rhs = *(const double *)rhs_p;
+        return (lhs > rhs) - (lhs < rhs);
+}
+
+static double
+quantile(const double *sorted, size_t n, double q)
+{
+        double pos = q * (n - 1);
+        size_t lo = pos;
+        size_t hi = lo + 1 < n ? lo + 1 : lo;
+        return sorted[lo] + (pos - lo) * (sorted[hi] - sorted[lo]);
+}
+
+/**
+ * Sorts the sample in place. With 'reject', values outside of
+ * Tukey's fences (1.5 IQR beyond the quartiles) are dropped first:
+ * a run hit by a cron job should not move the mean.
+ * Returns:
+ *      number of rejected values.
+ */
+size_t
+stats_compute(struct stats *stats, double *sample, size_t n, int reject)
+{
+        memset(stats, 0, sizeof(*stats));
+        if (!n)
+                return 0;
+
+        qsort(sample, n, sizeof(double), cmp_doubles);
+
+        size_t first = 0;
+        size_t last = n;
+        if (reject && n >= 4) {
+                double q1 = quantile(sample, n, 0.25);
+                double q3 = quantile(sample, n, 0.75);
+                double fence = 1.5 * (q3 - q1);
+                while (first != last && sample[first] < q1 - fence)
+                        first++;
+                while (last != first && sample[last - 1] > q3 + fence)
+                        last--;
+        }
+
+        const double *kept = sample + first;
+        size_t n_kept = last - first;
+
+        double sum = 0;
+        for (size_t i = 0; i != n_kept; i++)
+                sum += kept[i];
+
+        stats->n = n_kept;
+        stats->mean = sum / n_kept;
+        stats->median = quantile(kept, n_kept, 0.5);
+        stats->min = kept[0];
+        stats->max = kept[n_kept - 1];
+
+        if (n_kept > 1) {
+                double sq = 0;
+                for (size_t i = 0; i != n_kept; i++)
+                        sq += (kept[i] - stats->mean) * (kept[i] - stats->mean);
+
+                stats->stddev = sqrt(sq / (n_kept - 1));
+                stats->ci = t_quantile(n_kept - 1) * stats->stddev / sqrt(n_kept);
+        }
+
+        return n - n_kept;
+}
+
+/**
+ * Cost of spawning a child that exits at once and reaping it:
+ * every measured run pays it, and for short commands it is
+ * a good part of the number.
+ * Returns:
+ *      median over 'n_runs' attempts in ns.
+ */
+double
+fork_overhead(size_t n_runs)
+{
+        double *sample = calloc(n_runs, sizeof(double));
+        if (!sample)
+                return 0;
+
+        size_t n_done = 0;
+        for (; n_done != n_runs; n_done++) {
+                struct profile profile = {0};
+                if (run(NULL, &profile))
+                        break;
+
+                sample[n_done] = profile.real_ns;
+        }
+
+        struct stats stats;
+        stats_compute(&stats, sample, n_done, 0);
+        free(sample);
+        return stats.median;
+}
 
+/**
+ * All runs of one command.
+ */
+struct bench {
+        char **argv;
+        int status;
+
+        /* Sums over the runs, max for max rss */
+        struct rusage usage;
+        uint64_t fork_ns;
+        uint64_t exec_ns;
+        uint64_t run_ns;
+        uint64_t counts[N_COUNTERS];
+
+        double *real_ns;
+        struct stats real;
+        size_t n_outliers;
+};
+
+static void
+rusage_add(struct rusage *sum, const struct rusage *ru)
+{
+        timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+        timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+        if (ru->ru_maxrss > sum->ru_maxrss)
+                sum->ru_maxrss = ru->ru_maxrss;
+
+        sum->ru_majflt += ru->ru_majflt;
+        sum->ru_minflt += ru->ru_minflt;
+        sum->ru_nvcsw += ru->ru_nvcsw;
+        sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/**
+ * Warmup runs first (not recorded), then 'n_runs' measured ones.
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
+int
+bench_run(struct bench *bench, double overhead)
+{
+        bench->real_ns = calloc(opts.n_runs, sizeof(double));
+        if (!bench->real_ns)
+                return errno;
+
+        struct profile profile = {0};
+        for (size_t i = 0; i != opts.n_warmup; i++) {
+                int error = run(bench->argv, &profile);
+                if (error)
+                        return error;
+        }
+
+        if (opts.counters)
+                counters_reset();
+
+        for (size_t i = 0; i != opts.n_runs; i++) {
+                int error = run(bench->argv, &profile);
+                if (error)
+                        return error;
+
+                bench->fork_ns += profile.fork_ns;
+                bench->exec_ns += profile.exec_ns;
+                bench->run_ns += profile.run_ns;
+
+                double real = profile.real_ns - overhead;
+                bench->real_ns[i] = real > 0 ? real : 0;
+                bench->status = profile.status;
+                rusage_add(&bench->usage, &profile.usage);
+        }
+
+        if (opts.counters) {
+                counters_read();
+                for (size_t i = 0; i != N_COUNTERS; i++)
+                        bench->counts[i] = counters[i].value;
+        }
+
+        bench->n_outliers = stats_compute(&bench->real, bench->real_ns, opts.n_runs, opts.outliers);
         return 0;
 }
+
+void
+print_command(FILE *out, char *argv[])
+{
+        for (char **arg = argv; *arg; arg++)
+                fprintf(out, "%s%s", arg == argv ? "" : " ", *arg);
+}
+
+void
+print_human(FILE *out, const struct bench *bench)
+{
+        const struct rusage *ru = &bench->usage;
+        double n = opts.n_runs;
+
+        if (opts.n_runs > 1) {
+                fprintf(out, " '");
+                print_command(out, bench->argv);
+                fprintf(out, "' (%zu runs, %zu warmup, %zu outliers rejected):\n\n",
+                        opts.n_runs, opts.n_warmup, bench->n_outliers);
+        }
+
+        fprintf(out, "%16.6f s   real", bench->real.mean / 1e9);
+        if (opts.n_runs > 1) {
+                fprintf(out, "  +- %.6f (95%%)  median %.6f  stddev %.6f  min %.6f  max %.6f",
+                        bench->real.ci / 1e9, bench->real.median / 1e9, bench->real.stddev / 1e9,
+                        bench->real.min / 1e9, bench->real.max / 1e9);
+        }
+        fputc('\n', out);
+
+        fprintf(out, "%16.6f s     fork\n", bench->fork_ns / n / 1e9);
+        fprintf(out, "%16.6f s     exec\n", bench->exec_ns / n / 1e9);
+        fprintf(out, "%16.6f s     run (startup included)\n", bench->run_ns / n / 1e9);
+        fprintf(out, "%16.6f s   user\n", tv_us(&ru->ru_utime) / n / 1e6);
+        fprintf(out, "%16.6f s   sys\n",  tv_us(&ru->ru_stime) / n / 1e6);
+        fprintf(out, "%16ld KiB max rss\n", ru->ru_maxrss);
+        fprintf(out, "%16.0f     major page faults\n", ru->ru_majflt / n);
+        fprintf(out, "%16.0f     minor page faults\n", ru->ru_minflt / n);
+        fprintf(out, "%16.0f     voluntary context switches\n", ru->ru_nvcsw / n);
+        fprintf(out, "%16.0f     involuntary context switches\n", ru->ru_nivcsw / n);
+
+        if (!opts.counters)
+                return;
+
+        for (size_t i = 0; i != N_COUNTERS; i++) {
+                const struct counter *counter = &counters[i];
+                if (counter->fd == -1) {
+                        fprintf(out, "%16s     %s\n", "<not supported>", counter->name);
+                        continue;
+                }
+
+                fprintf(out, "%16.0f     %s", bench->counts[i] / n, counter->name);
+                if (counter->running < 1)
+                        fprintf(out, " (%.1f%% counted)", counter->running * 100);
+                fputc('\n', out);
+        }
+}
+
+void
+print_json(FILE *out, const struct bench *bench)
+{
+        const struct rusage *ru = &bench->usage;
+        double n = opts.n_runs;
+
+        fprintf(out, "{\"command\": [");
+        for (char **arg = bench->argv; *arg; arg++) {
+                fprintf(out, "%s\"", arg == bench->argv ? "" : ", ");
+                for (const char *c = *arg; *c; c++) {
+                        if (*c == '"' || *c == '\\')
+                                fprintf(out, "\\%c", *c);
+                        else if ((unsigned char)*c < 0x20)
+                                fprintf(out, "\\u%04x", *c);
+                        else
+                                fputc(*c, out);
+                }
+                fputc('"', out);
+        }
+        fprintf(out, "], ");
+
+        if (WIFSIGNALED(bench->status))
+                fprintf(out, "\"signal\": %d, ", WTERMSIG(bench->status));
+        else
+                fprintf(out, "\"status\": %d, ", WEXITSTATUS(bench->status));
+
+        /* Per run means */
+        fprintf(out, "\"fork_ns\": %.0f, \"exec_ns\": %.0f, \"run_ns\": %.0f, ",
+                bench->fork_ns / n, bench->exec_ns / n, bench->run_ns / n);
+        fprintf(out, "\"real_ns\": %.0f, \"user_us\": %.0f, \"sys_us\": %.0f, "
+                     "\"max_rss_kib\": %ld, \"major_faults\": %.0f, \"minor_faults\": %.0f, "
+                     "\"voluntary_switches\": %.0f, \"involuntary_switches\": %.0f",
+                bench->real.mean, tv_us(&ru->ru_utime) / n, tv_us(&ru->ru_stime) / n,
+                ru->ru_maxrss, ru->ru_majflt / n, ru->ru_minflt / n, ru->ru_nvcsw / n, ru->ru_nivcsw / n);
+
+        if (opts.n_runs > 1) {
+                fprintf(out, ", \"runs\": %zu, \"warmup\": %zu, \"outliers\": %zu, "
+                             "\"real\": {\"mean\": %.0f, \"median\": %.0f, \"stddev\": %.0f, "
+                             "\"min\": %.0f, \"max\": %.0f, \"ci95\": %.0f}",
+                        opts.n_runs, opts.n_warmup, bench->n_outliers,
+                        bench->real.mean, bench->real.median, bench->real.stddev,
+                        bench->real.min, bench->real.max, bench->real.ci);
+        }
+
+        if (opts.counters) {
+                fprintf(out, ", \"counters\": {");
+                for (size_t i = 0; i != N_COUNTERS; i++) {
+                        const struct counter *counter = &counters[i];
+                        fprintf(out, "%s\"%s\": ", i ? ", " : "", counter->name);
+                        if (counter->fd == -1)
+                                fprintf(out, "null");
+                        else
+                                fprintf(out, "%.0f", bench->counts[i] / n);
+                }
+                fprintf(out, "}");
+        }
+
+        fprintf(out, "}");
+}
+
+/**
+ * How many times 'fast' is faster than 'slow', with the error
+ * propagated from both standard deviations, and Welch's t-test
+ * for whether the means differ at all.
+ */
+struct comparison {
+        double ratio;
+        double error;
+        double t;
+        int significant;
+};
+
+void
+compare(struct comparison *cmp, const struct stats *base, const struct stats *other)
+{
+        cmp->ratio = base->mean / other->mean;
+        cmp->error = cmp->ratio * sqrt(pow(base->stddev / base->mean, 2) +
+                                       pow(other->stddev / other->mean, 2));
+
+        double var_base = base->stddev * base->stddev / base->n;
+        double var_other = other->stddev * other->stddev / other->n;
+        double var = var_base + var_other;
+        if (var == 0 || base->n < 2 || other->n < 2) {
+                cmp->t = 0;
+                cmp->significant = 0;
+                return;
+        }
+
+        double df = var * var / (var_base * var_base / (base->n - 1) +
+                                 var_other * var_other / (other->n - 1));
+        cmp->t = (base->mean - other->mean) / sqrt(var);
+        cmp->significant = fabs(cmp->t) > t_quantile(df);
+}
+
+void
+print_comparison(FILE *out, const struct bench *base, const struct bench *other,
+                 const struct comparison *cmp)
+{
+        if (opts.json) {
+                fprintf(out, "{\"speedup\": %.4f, \"error\": %.4f, \"t\": %.3f, \"significant\": %s}",
+                        cmp->ratio, cmp->error, cmp->t, cmp->significant ? "true" : "false");
+                return;
+        }
+
+        int faster = cmp->ratio >= 1;
+        fprintf(out, "\n '");
+        print_command(out, other->argv);
+        fprintf(out, "' ran %.3f +- %.3f times %s than '", faster ? cmp->ratio : 1 / cmp->ratio,
+                faster ? cmp->error : cmp->error / (cmp->ratio * cmp->ratio),
+                faster ? "faster" : "slower");
+        print_command(out, base->argv);
+        fprintf(out, "'\n Welch t = %.2f: the difference is %s at 95%%\n", cmp->t,
+                cmp->significant ? "significant" : "NOT significant");
+}
+
+static void
+usage(const char *name)
+{
+        fprintf(stderr, "Usage: %s [-j] [-p] [-o file] [-r runs] [-w warmup] [-x] command [args...]\n"
+                        "       %s [options] -c command [args...] -- command [args...]\n"
+                        "  -j  print JSON instead of the table\n"
+                        "  -p  count cycles, instructions, cache and branch misses\n"
+                        "  -o  write the report to file instead of stderr\n"
+                        "  -r  run the command several times and print statistics\n"
+                        "  -w  unrecorded warmup runs before that\n"
+                        "  -x  reject outliers beyond 1.5 IQR\n"
+                        "  -c  compare two commands separated by '--'\n", name, name);
+}
+
+int
+main(int argc, char *argv[])
+{
+        opts.out = stderr;
+        opts.n_runs = 1;
+        int comparing = 0;
+
+        int opt = 0;
+        /* '+': options after the command belong to it */
+        while ((opt = getopt(argc, argv, "+jpo:r:w:xc")) != -1) {
+                switch (opt) {
+                case 'j':
+                        opts.json = 1;
+                        break;
+                case 'p':
+                        opts.counters = 1;
+                        break;
+                case 'o':
+                        opts.out = fopen(optarg, "w");
+                        if (!opts.out) {
+                                perror(optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'r':
+                        opts.n_runs = strtoul(optarg, NULL, 0);
+                        break;
+                case 'w':
+                        opts.n_warmup = strtoul(optarg, NULL, 0);
+                        break;
+                case 'x':
+                        opts.outliers = 1;
+                        break;
+                case 'c':
+                        comparing = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (optind == argc || !opts.n_runs) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        struct bench benches[2] = {{.argv = argv + optind}};
+        size_t n_benches = 1;
+
+        if (comparing) {
+                char **sep = benches[0].argv;
+                while (*sep && strcmp(*sep, "--"))
+                        sep++;
+
+                if (!*sep || sep == benches[0].argv || !sep[1]) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+
+                *sep = NULL;
+                benches[1].argv = sep + 1;
+                n_benches = 2;
+        }
+
+        if (opts.counters)
+                counters_open();
+
+        /* A single run is reported as is, statistics subtract the fork cost */
+        double overhead = 0;
+        if (opts.n_runs > 1 || comparing)
+                overhead = fork_overhead(opts.n_runs < 10 ? 10 : opts.n_runs);
+
+        for (size_t i = 0; i != n_benches; i++) {
+                int error = bench_run(&benches[i], overhead);
+                if (error) {
+                        fprintf(stderr, "%s: %s\n", *benches[i].argv, strerror(error));
+                        return error == ENOENT ? ENOENT : EXIT_FAILURE;
+                }
+        }
+
+        struct comparison cmp = {0};
+        if (comparing)
+                compare(&cmp, &benches[0].real, &benches[1].real);
+
+        if (opts.json) {
+                if (comparing)
+                        fprintf(opts.out, "{\"fork_overhead_ns\": %.0f, \"benchmarks\": [", overhead);
+                for (size_t i = 0; i != n_benches; i++) {
+                        fprintf(opts.out, "%s", i ? ", " : "");
+                        print_json(opts.out, &benches[i]);
+                }
+                if (comparing) {
+                        fprintf(opts.out, "], \"comparison\": ");
+                        print_comparison(opts.out, &benches[0], &benches[1], &cmp);
+                        fprintf(opts.out, "}");
+                }
+                fputc('\n', opts.out);
+        } else {
+                if (overhead)
+                        fprintf(opts.out, " spawn overhead %.1f us subtracted from every run\n\n",
+                                overhead / 1e3);
+                for (size_t i = 0; i != n_benches; i++) {
+                        if (i)
+                                fputc('\n', opts.out);
+                        print_human(opts.out, &benches[i]);
+                }
+                if (comparing)
+                        print_comparison(opts.out, &benches[0], &benches[1], &cmp);
+        }
+
+        int status = benches[n_benches - 1].status;
+        for (size_t i = 0; i != n_benches; i++)
+                free(benches[i].real_ns);
+
+        counters_close();
+        if (opts.out != stderr)
+                fclose(opts.out);
+
+        if (WIFSIGNALED(status))
+                return 128 + WTERMSIG(status);
+
+        return WEXITSTATUS(status);
+}
@@ -0,0 +1,375 @@
+/**
+ * Hot-path tracing shared by the tools.
+ *
+ * Probes are always compiled in. Unless TRACE_OUT names a file, a probe
+ * costs one well-predicted branch. With TRACE_OUT set, every thread
+ * records timestamped events into its own ring buffer. The rings are
+ * written to that file as Chrome trace JSON, which chrome://tracing and
+ * ui.perfetto.dev can open. This happens at exit, on SIGUSR2 (a snapshot,
+ * the process goes on), and on SIGINT or SIGTERM right before the
+ * process dies, if the tool does not handle those itself.
+ *
+ *   TRACE_OUT=monitor.json monitor big.txt > /dev/null
+ *
+ * A ring belongs to one thread, which is its only writer, so recording
+ * takes no locks and no atomic read-modify-write: the event is filled
+ * in and then published by a release store of the head. When a ring
+ * wraps, the oldest events are overwritten and counted as dropped.
+ * As in a seqlock, the head is the sequence: a release fence keeps the
+ * store that retired a slot's old event ahead of overwriting the slot.
+ * The event fields are relaxed atomics, plain moves on every target,
+ * so that a dump reading a slot being overwritten is not a data race.
+ *
+ * Names are stored by pointer, so they must be string literals
+ * (or __func__) and must not need escaping in JSON.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+/* Events kept per thread, a power of two */
+#ifndef TRACE_RING
+#define TRACE_RING (1 << 14)
+#endif
+
+struct trace_event {
+        uint64_t ns;
+        const char *name;
+        int64_t arg;
+        char ph;        /* Chrome trace phase: B, E, i or C */
+};
+
+struct trace_ring {
+        _Atomic uint64_t head;
+        struct trace_ring *next;
+        pid_t tid;
+        const char *name;
+        struct trace_event events[TRACE_RING];
+};
+
+static struct {
+        int on;
+        pid_t pid;
+        uint64_t start;
+        const char *path;
+        char comm[32];
+        _Atomic(struct trace_ring *) rings;
+        atomic_int dumping;
+} trace_state;
+
+static __thread struct trace_ring *trace_self;
+
+#define TRACE_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define TRACE_LOAD(field)         __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/**
+ * ThreadSanitizer does not model fences and GCC warns about them.
+ * The fields being atomics, it has no race to report without them.
+ */
+#if defined(__SANITIZE_THREAD__)
+#define TRACE_FENCE(order) ((void)0)
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define TRACE_FENCE(order) ((void)0)
+#endif
+#endif
+#ifndef TRACE_FENCE
+#define TRACE_FENCE(order) atomic_thread_fence(order)
+#endif
+
+static inline uint64_t
+trace_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* First event of a thread. Rings live until exit so they can be dumped. */
+static __attribute__((noinline)) struct trace_ring *
+trace_ring_new(void)
+{
+        struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+        if (!ring)
+                return NULL;
+
+        ring->tid = (pid_t)syscall(SYS_gettid);
+        ring->next = atomic_load(&trace_state.rings);
+        while (!atomic_compare_exchange_weak(&trace_state.rings, &ring->next, ring))
+                ;
+
+        trace_self = ring;
+        return ring;
+}
+
+static inline void
+trace_emit(char ph, const char *name, int64_t arg)
+{
+        if (__builtin_expect(!trace_state.on, 1))
+                return;
+
+        struct trace_ring *ring = trace_self;
+        if (!ring && !(ring = trace_ring_new()))
+                return;
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        struct trace_event *ev = &ring->events[head & (TRACE_RING - 1)];
+
+        /* Pairs with the acquire fence in trace_dump() */
+        TRACE_FENCE(memory_order_release);
+        TRACE_STORE(ev->ns, trace_now());
+        TRACE_STORE(ev->name, name);
+        TRACE_STORE(ev->arg, arg);
+        TRACE_STORE(ev->ph, ph);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Names the calling thread in the trace */
+static inline void
+trace_thread(const char *name)
+{
+        if (!trace_state.on)
+                return;
+
+        struct trace_ring *ring = trace_self;
+        if (ring || (ring = trace_ring_new()))
+                TRACE_STORE(ring->name, name);
+}
+
+static inline void
+trace_scope_end(const char **name)
+{
+        trace_emit('E', *name, 0);
+}
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b)  TRACE_CAT_(a, b)
+
+#define TRACE_BEGIN(name)          trace_emit('B', (name), 0)
+#define TRACE_END(name)            trace_emit('E', (name), 0)
+#define TRACE_INSTANT(name, value) trace_emit('i', (name), (int64_t)(value))
+#define TRACE_COUNTER(name, value) trace_emit('C', (name), (int64_t)(value))
+
+/* Begin here, end when the enclosing block is left */
+#define TRACE_SCOPE(name)                                               \
+        const char *TRACE_CAT(trace_scope_, __LINE__)                   \
+        __attribute__((cleanup(trace_scope_end))) = (TRACE_BEGIN(name), (name))
+
+/**
+ * The dump runs from signal handlers too, so it formats by hand into
+ * a static buffer and only uses write(). Another thread may be
+ * overwriting the oldest events of its ring meanwhile. Each event is
+ * therefore copied first, and kept only if the head has not
+ * come around to its slot by then. Whatever part of the copy a
+ * writer's new event reached, the fences make that recheck see it.
+ */
+static char trace_buf[0x2000];
+static size_t trace_len;
+static int trace_fd;
+
+static void
+trace_flush(void)
+{
+        for (size_t done = 0; done < trace_len;) {
+                ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+                if (n <= 0)
+                        break;
+                done += (size_t)n;
+        }
+        trace_len = 0;
+}
+
+static void
+trace_put(const char *s)
+{
+        for (; *s; s++) {
+                if (trace_len == sizeof(trace_buf))
+                        trace_flush();
+                trace_buf[trace_len++] = *s;
+        }
+}
+
+static void
+trace_put_u64(uint64_t v)
+{
+        char digits[24];
+        char *p = digits + sizeof(digits);
+        *--p = '\0';
+        do
+                *--p = (char)('0' + v % 10);
+        while (v /= 10);
+        trace_put(p);
+}
+
+static void
+trace_put_i64(int64_t v)
+{
+        if (v < 0) {
+                trace_put("-");
+                trace_put_u64(-(uint64_t)v);
+        } else {
+                trace_put_u64((uint64_t)v);
+        }
+}
+
+/* {"ph":"X","name":"N","pid":P,"tid":T */
+static void
+trace_put_head(char ph, const char *name, pid_t tid)
+{
+        char phase[2] = { ph, '\0' };
+        trace_put("{\"ph\":\"");
+        trace_put(phase);
+        trace_put("\",\"name\":\"");
+        trace_put(name);
+        trace_put("\",\"pid\":");
+        trace_put_u64((uint64_t)trace_state.pid);
+        trace_put(",\"tid\":");
+        trace_put_u64((uint64_t)tid);
+}
+
+static void
+trace_put_event(const struct trace_event *ev, pid_t tid)
+{
+        uint64_t ns = ev->ns - trace_state.start;
+
+        trace_put(",\n");
+        trace_put_head(ev->ph, ev->name, tid);
+        trace_put(",\"ts\":");
+        trace_put_u64(ns / 1000);
+        trace_put(".");
+        trace_put_u64(ns / 100 % 10);
+        trace_put_u64(ns / 10 % 10);
+        trace_put_u64(ns % 10);
+
+        if (ev->ph == 'i')
+                trace_put(",\"s\":\"t\"");
+        if (ev->ph == 'i' || ev->ph == 'C') {
+                trace_put(",\"args\":{\"value\":");
+                trace_put_i64(ev->arg);
+                trace_put("}");
+        }
+        trace_put("}");
+}
+
+static void
+trace_dump(void)
+{
+        /* Forked children inherit the rings but not the file */
+        if (!trace_state.on || getpid() != trace_state.pid)
+                return;
+        if (atomic_exchange(&trace_state.dumping, 1))
+                return;
+
+        trace_fd = open(trace_state.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (trace_fd == -1) {
+                atomic_store(&trace_state.dumping, 0);
+                return;
+        }
+
+        trace_len = 0;
+        trace_put("{\"traceEvents\":[\n");
+        trace_put_head('M', "process_name", trace_state.pid);
+        trace_put(",\"args\":{\"name\":\"");
+        trace_put(trace_state.comm);
+        trace_put("\"}}");
+
+        uint64_t dropped = 0;
+        for (struct trace_ring *ring = atomic_load(&trace_state.rings); ring; ring = ring->next) {
+                const char *name = TRACE_LOAD(ring->name);
+                if (name) {
+                        trace_put(",\n");
+                        trace_put_head('M', "thread_name", ring->tid);
+                        trace_put(",\"args\":{\"name\":\"");
+                        trace_put(name);
+                        trace_put("\"}}");
+                }
+
+                uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+                uint64_t first = head > TRACE_RING ? head - TRACE_RING : 0;
+                dropped += first;
+
+                for (uint64_t i = first; i != head; i++) {
+                        const struct trace_event *slot = &ring->events[i & (TRACE_RING - 1)];
+                        struct trace_event ev = {
+                                .ns = TRACE_LOAD(slot->ns),
+                                .name = TRACE_LOAD(slot->name),
+                                .arg = TRACE_LOAD(slot->arg),
+                                .ph = TRACE_LOAD(slot->ph),
+                        };
+                        TRACE_FENCE(memory_order_acquire);
+                        if (atomic_load_explicit(&ring->head, memory_order_relaxed) >= i + TRACE_RING) {
+                                dropped++;
+                                continue;
+                        }
+                        trace_put_event(&ev, ring->tid);
+                }
+        }
+
+        trace_put("\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":");
+        trace_put_u64(dropped);
+        trace_put("}}\n");
+        trace_flush();
+        close(trace_fd);
+
+        atomic_store(&trace_state.dumping, 0);
+}
+
+static void
+trace_on_signal(int sig)
+{
+        int saved_errno = errno;
+        trace_dump();
+        errno = saved_errno;
+
+        if (sig != SIGUSR2) {
+                signal(sig, SIG_DFL);
+                raise(sig);
+        }
+}
+
+static __attribute__((constructor)) void
+trace_ctor(void)
+{
+        const char *path = getenv("TRACE_OUT");
+        if (!path || !*path)
+                return;
+
+        trace_state.path = path;
+        trace_state.pid = getpid();
+        trace_state.start = trace_now();
+
+        int fd = open("/proc/self/comm", O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+                ssize_t n = read(fd, trace_state.comm, sizeof(trace_state.comm) - 1);
+                if (n > 0 && trace_state.comm[n - 1] == '\n')
+                        n--;
+                trace_state.comm[n > 0 ? n : 0] = '\0';
+                close(fd);
+        }
+
+        struct sigaction sa = { .sa_handler = trace_on_signal, .sa_flags = SA_RESTART };
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR2, &sa, NULL);
+
+        int fatal[] = { SIGINT, SIGTERM };
+        for (size_t i = 0; i != sizeof(fatal) / sizeof(fatal[0]); i++) {
+                struct sigaction old;
+                if (sigaction(fatal[i], NULL, &old) == 0 && old.sa_handler == SIG_DFL)
+                        sigaction(fatal[i], &sa, NULL);
+        }
+
+        atexit(trace_dump);
+        trace_state.on = 1;
+}
+
+#endif /* TRACE_H */
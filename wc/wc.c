@@ -1,18 +1,527 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
-int main(int argc, char *argv[])
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WC_X86
+#endif
+
+struct counts {
+        size_t lines;
+        size_t words;
+        size_t bytes;
+};
+
+/**
+ * Counter state carried between blocks.
+ * Word start is a non-space byte preceded by a space,
+ * so we only need to know whether the last byte was a space.
+ */
+struct counter {
+        struct counts cnt;
+        int in_word;
+};
+
+/* Same set as isspace() in the "C" locale: ' ', '\t', '\n', '\v', '\f', '\r' */
+static inline int
+is_space(unsigned char c)
+{
+        return c == ' ' || (unsigned char)(c - '\t') < 5;
+}
+
+static void
+count_scalar(struct counter *ctr, const unsigned char *buf, size_t size)
+{
+        size_t lines = 0;
+        size_t words = 0;
+        int in_word = ctr->in_word;
+
+        for (size_t i = 0; i < size; i++) {
+                if (buf[i] == '\n')
+                        lines++;
+
+                int space = is_space(buf[i]);
+                words += !space & !in_word;
+                in_word = !space;
+        }
+
+        ctr->cnt.lines += lines;
+        ctr->cnt.words += words;
+        ctr->in_word = in_word;
+}
+
+/**
+ * Both vector paths reduce 64 bytes to two bitmasks: newlines and spaces.
+ * Lines are popcount of the first one.
+ * Word starts are non-space bits whose previous bit is a space:
+ *
+ *      starts = ~ws & (ws << 1 | carry)
+ *
+ * where carry is the top bit of the previous block.
+ */
+static inline void
+count_masks(struct counter *ctr, uint64_t nl, uint64_t ws, uint64_t *carry)
+{
+        uint64_t starts = ~ws & ((ws << 1) | *carry);
+        *carry = ws >> 63;
+
+        ctr->cnt.lines += __builtin_popcountll(nl);
+        ctr->cnt.words += __builtin_popcountll(starts);
+}
+
+#ifdef WC_X86
+__attribute__((target("sse2")))
+static void
+count_sse2(struct counter *ctr, const unsigned char *buf, size_t size)
+{
+        const __m128i nl = _mm_set1_epi8('\n');
+        const __m128i sp = _mm_set1_epi8(' ');
+        const __m128i lo = _mm_set1_epi8('\t' - 1);
+        const __m128i hi = _mm_set1_epi8('\r' + 1);
+
+        uint64_t carry = !ctr->in_word;
+        size_t i = 0;
+        for (; i + 64 <= size; i += 64) {
+                uint64_t nl_mask = 0;
+                uint64_t ws_mask = 0;
+                for (size_t k = 0; k != 4; k++) {
+                        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i + 16 * k));
+
+                        /* Signed compare: bytes >= 0x80 are negative, thus never spaces */
+                        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, sp),
+                                                  _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+                                                                _mm_cmplt_epi8(v, hi)));
+
+                        nl_mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * k);
+                        ws_mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << (16 * k);
+                }
+
+                count_masks(ctr, nl_mask, ws_mask, &carry);
+        }
+
+        ctr->in_word = !carry;
+        count_scalar(ctr, buf + i, size - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void
+count_avx2(struct counter *ctr, const unsigned char *buf, size_t size)
+{
+        const __m256i nl = _mm256_set1_epi8('\n');
+        const __m256i sp = _mm256_set1_epi8(' ');
+        const __m256i lo = _mm256_set1_epi8('\t' - 1);
+        const __m256i hi = _mm256_set1_epi8('\r' + 1);
+
+        uint64_t carry = !ctr->in_word;
+        size_t i = 0;
+        for (; i + 64 <= size; i += 64) {
+                __m256i v0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+                __m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+
+                __m256i ws0 = _mm256_or_si256(_mm256_cmpeq_epi8(v0, sp),
+                                              _mm256_and_si256(_mm256_cmpgt_epi8(v0, lo),
+                                                               _mm256_cmpgt_epi8(hi, v0)));
+                __m256i ws1 = _mm256_or_si256(_mm256_cmpeq_epi8(v1, sp),
+                                              _mm256_and_si256(_mm256_cmpgt_epi8(v1, lo),
+                                                               _mm256_cmpgt_epi8(hi, v1)));
+
+                uint64_t nl_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, nl)) |
+                                   (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, nl)) << 32;
+                uint64_t ws_mask = (uint32_t)_mm256_movemask_epi8(ws0) |
+                                   (uint64_t)(uint32_t)_mm256_movemask_epi8(ws1) << 32;
+
+                count_masks(ctr, nl_mask, ws_mask, &carry);
+        }
+
+        ctr->in_word = !carry;
+        count_scalar(ctr, buf + i, size - i);
+}
+#endif /* WC_X86 */
+
+typedef void (*count_fn)(struct counter *ctr, const unsigned char *buf, size_t size);
+
+/**
+ * Pick the widest counting engine the CPU supports.
+ */
+static count_fn
+count_select()
+{
+#ifdef WC_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+                return count_avx2;
+        if (__builtin_cpu_supports("sse2"))
+                return count_sse2;
+#endif
+        return count_scalar;
+}
+
+/* Large aligned read buffer: fewer syscalls, whole cache lines for vector loads */
+#define WC_BUFSZ  (1 << 20)
+#define WC_ALIGN  64
+
+/* Files smaller than this are not worth waking up threads for */
+#define WC_CHUNK_MIN (16 << 20)
+
+static count_fn count;
+
+static struct {
+        int files;
+        int tee;
+        double period;
+        long n_threads;
+} opts = {0, 0, 0, 0};
+
+/**
+ * Inline throughput meter for tee mode.
+ * Prints to stderr at most once per 'opts.period' seconds.
+ */
+struct meter {
+        struct timespec start;
+        struct timespec last;
+        size_t last_bytes;
+};
+
+static double
+seconds(const struct timespec *from, const struct timespec *to)
+{
+        return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void
+meter_update(struct meter *meter, const struct counts *cnt, int done)
+{
+        if (opts.period <= 0)
+                return;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        double dt = seconds(&meter->last, &now);
+        if (!done && dt < opts.period)
+                return;
+
+        const double mib = 1 << 20;
+        double elapsed = seconds(&meter->start, &now);
+
+        /* Redraw in place on a terminal, one line per report otherwise */
+        fprintf(stderr, "%swc: %zu bytes %zu lines %.1f MiB/s (avg %.1f MiB/s)%s",
+                isatty(2) ? "\r" : "", cnt->bytes, cnt->lines,
+                dt > 0 ? (cnt->bytes - meter->last_bytes) / mib / dt : 0.0,
+                elapsed > 0 ? cnt->bytes / mib / elapsed : 0.0,
+                isatty(2) && !done ? "" : "\n");
+
+        meter->last = now;
+        meter->last_bytes = cnt->bytes;
+}
+
+static int
+write_all(int fd, const unsigned char *buf, size_t size)
+{
+        /**
+         * write() may transfer fewer than size bytes.
+         * In the event of partial write, make another write
+         * to transfer the remaining bytes.
+         */
+        for (size_t n_left = size; n_left;) {
+                ssize_t n_written = write(fd, buf + size - n_left, n_left);
+                if (n_written == -1 && errno == EINTR)
+                        continue;
+                if (n_written == -1)
+                        return errno;
+
+                n_left -= n_written;
+        }
+
+        return 0;
+}
+
+/**
+ * Count everything readable from fd with large read() calls.
+ *
+ * In tee mode data is also forwarded to stdout. When both ends are pipes
+ * tee() duplicates the pipe pages to stdout without copying, and read()
+ * then only consumes the same number of bytes for counting.
+ * Otherwise counted data is written out from the buffer.
+ *
+ * Returns:
+ *      0 on success, errno otherwise.
+ */
+int
+count_fd(int fd, struct counts *cnt)
+{
+        assert(cnt);
+
+        unsigned char *buf = aligned_alloc(WC_ALIGN, WC_BUFSZ);
+        if (!buf)
+                return errno;
+
+        struct counter ctr = {0};
+        struct meter meter = {0};
+        clock_gettime(CLOCK_MONOTONIC, &meter.start);
+        meter.last = meter.start;
+
+        int zero_copy = opts.tee;
+        int error = 0;
+
+        for (;;) {
+                size_t n_want = WC_BUFSZ;
+                if (zero_copy) {
+                        ssize_t n_teed = tee(fd, 1, WC_BUFSZ, 0);
+                        if (n_teed == -1 && errno == EINTR)
+                                continue;
+                        if (n_teed == -1 && errno == EINVAL) {
+                                zero_copy = 0;
+                                continue;
+                        }
+                        if (n_teed == -1) {
+                                error = errno;
+                                break;
+                        }
+                        if (n_teed == 0)
+                                break;
+
+                        n_want = n_teed;
+                }
+
+                /* Consume exactly what was teed, or the next pipe page gets duplicated */
+                size_t n_done = 0;
+                do {
+                        ssize_t n_read = read(fd, buf, n_want - n_done);
+                        if (n_read == -1 && errno == EINTR)
+                                continue;
+                        if (n_read == -1)
+                                error = errno;
+                        if (n_read <= 0)
+                                break;
+
+                        if (opts.tee && !zero_copy)
+                                error = write_all(1, buf, n_read);
+
+                        count(&ctr, buf, n_read);
+                        ctr.cnt.bytes += n_read;
+                        n_done += n_read;
+                } while (!error && zero_copy && n_done != n_want);
+
+                meter_update(&meter, &ctr.cnt, 0);
+                if (error || n_done == 0)
+                        break;
+        }
+
+        if (!error)
+                meter_update(&meter, &ctr.cnt, 1);
+
+        free(buf);
+        *cnt = ctr.cnt;
+        return error;
+}
+
+struct chunk {
+        const unsigned char *data;
+        size_t size;
+        struct counts cnt;
+};
+
+void *
+load_chunk(void *args_p)
+{
+        struct chunk *chunk = (struct chunk *)args_p;
+        struct counter ctr = {0};
+
+        count(&ctr, chunk->data, chunk->size);
+        chunk->cnt = ctr.cnt;
+        return NULL;
+}
+
+/**
+ * Count mapped data split into disjoint chunks, one thread per chunk.
+ *
+ * Every chunk is counted as if it started after a space,
+ * so a word crossing the chunk boundary is counted twice.
+ * Subtract one for each boundary with non-space bytes on both sides,
+ * which makes the result exactly equal to the sequential count.
+ */
+int
+count_chunks(const unsigned char *data, size_t size, struct counts *cnt)
+{
+        assert(data && cnt);
+
+        size_t n_chunks = size / WC_CHUNK_MIN;
+        if (n_chunks > (size_t)opts.n_threads)
+                n_chunks = opts.n_threads;
+        if (n_chunks == 0)
+                n_chunks = 1;
+
+        struct chunk *chunks = calloc(n_chunks, sizeof(struct chunk));
+        pthread_t *tids = calloc(n_chunks, sizeof(pthread_t));
+        if (!chunks || !tids)
+                return free(chunks), free(tids), errno;
+
+        size_t chunk_sz = size / n_chunks;
+        for (size_t i = 0; i != n_chunks; i++) {
+                chunks[i].data = data + i * chunk_sz;
+                chunks[i].size = (i == n_chunks - 1) ? size - i * chunk_sz : chunk_sz;
+        }
+
+        /* The first chunk is counted by the calling thread itself */
+        size_t n_started = 1;
+        for (; n_started != n_chunks; n_started++)
+                if (pthread_create(&tids[n_started], NULL, load_chunk, &chunks[n_started]))
+                        break;
+
+        load_chunk(&chunks[0]);
+
+        /* Chunks we could not start a thread for are counted here */
+        for (size_t i = n_started; i != n_chunks; i++)
+                load_chunk(&chunks[i]);
+
+        for (size_t i = 1; i != n_started; i++)
+                pthread_join(tids[i], NULL);
+
+        struct counts total = {0};
+        for (size_t i = 0; i != n_chunks; i++) {
+                total.lines += chunks[i].cnt.lines;
+                total.words += chunks[i].cnt.words;
+
+                if (i != 0 && !is_space(chunks[i].data[-1]) && !is_space(chunks[i].data[0]))
+                        total.words--;
+        }
+
+        total.bytes = size;
+        *cnt = total;
+
+        free(chunks);
+        free(tids);
+        return 0;
+}
+
+/**
+ * Count opened file: map regular files, read anything else.
+ */
+int
+count_file(int fd, struct counts *cnt)
 {
-        memmove(argv, argv + 1, sizeof(char *) * argc);
-        argv[argc] = NULL;
+        struct stat st = {0};
+        if (fstat(fd, &st) == -1)
+                return errno;
+
+        if (!S_ISREG(st.st_mode) || st.st_size == 0 || opts.tee)
+                return count_fd(fd, cnt);
+
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+                return count_fd(fd, cnt);
+
+        madvise(data, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+        int error = count_chunks(data, st.st_size, cnt);
+        munmap(data, st.st_size);
+        return error;
+}
+
+static int
+n_digits(size_t n)
+{
+        int digits = 1;
+        while (n /= 10)
+                digits++;
+
+        return digits;
+}
+
+/**
+ * coreutils-compatible file mode:
+ *      wc -f [-j threads] [FILE]...
+ *
+ * Without FILE, or when FILE is '-', read standard input.
+ * In tee mode the data goes to stdout, so counts go to stderr.
+ */
+int
+count_files(int n_files, char *files[])
+{
+        char *stdin_name[] = {"-"};
+        if (n_files == 0)
+                n_files = 1, files = stdin_name;
+
+        struct counts *cnts = calloc(n_files, sizeof(struct counts));
+        int *failed = calloc(n_files, sizeof(int));
+        if (!cnts || !failed)
+                return free(cnts), free(failed), perror("wc"), EXIT_FAILURE;
+
+        int status = 0;
+        int width = 1;
+        struct counts total = {0};
+        FILE *out = opts.tee ? stderr : stdout;
 
+        for (int i = 0; i != n_files; i++) {
+                int is_stdin = !strcmp(files[i], "-");
+                int fd = is_stdin ? 0 : open(files[i], O_RDONLY);
+
+                struct stat st = {0};
+                int error = (fd == -1) ? errno : 0;
+                if (!error && fstat(fd, &st) == 0 && !S_ISREG(st.st_mode))
+                        width = 7;
+
+                if (!error)
+                        error = count_file(fd, &cnts[i]);
+
+                if (fd > 0)
+                        close(fd);
+
+                if (error) {
+                        fprintf(stderr, "wc: %s: %s\n", files[i], strerror(error));
+                        failed[i] = 1;
+                        status = EXIT_FAILURE;
+                        continue;
+                }
+
+                total.lines += cnts[i].lines;
+                total.words += cnts[i].words;
+                total.bytes += cnts[i].bytes;
+        }
+
+        /* Every count is bounded by the total byte count */
+        if (width < n_digits(total.bytes))
+                width = n_digits(total.bytes);
+
+        for (int i = 0; i != n_files; i++) {
+                if (failed[i])
+                        continue;
+
+                fprintf(out, "%*zu %*zu %*zu", width, cnts[i].lines, width, cnts[i].words,
+                                               width, cnts[i].bytes);
+
+                if (files[i] != stdin_name[0])
+                        fprintf(out, " %s", files[i]);
+
+                fprintf(out, "\n");
+        }
+
+        if (n_files > 1)
+                fprintf(out, "%*zu %*zu %*zu total\n", width, total.lines, width, total.words,
+                                                       width, total.bytes);
+
+        free(cnts);
+        free(failed);
+        return status;
+}
+
+int
+count_command(char *argv[])
+{
         /* Prepare pipe */
         int fds[2];
         if (pipe(fds) == -1)
@@ -34,46 +543,15 @@ int main(int argc, char *argv[])
 
         close(fds[1]);
 
-        char buf[0xff] = {0};
-
-        ssize_t n_read = 0;
+        /* Bigger pipe means fewer context switches per byte, failure is harmless */
+        fcntl(fds[0], F_SETPIPE_SZ, WC_BUFSZ);
 
-        size_t lines = 0;
-        size_t words = 0;
-        size_t bytes = 0;
-
-        enum states {
-                WORD,
-                NOWORD,
-        };
-
-        int state = NOWORD;
-        do {
-                n_read = read(fds[0], buf, sizeof(buf));
-                for (size_t i = 0; i < n_read; i++) {
-
-                        if (buf[i] == '\n')
-                                lines++;
-
-                        switch (state) {
-                        case WORD:
-                                if (isspace(buf[i]))
-                                        state = NOWORD;
-                                break;
-                        case NOWORD:
-                                if (isspace(buf[i]))
-                                        continue;
-
-                                state = WORD;
-                                words++;
-                                break;
-                        default:
-                                assert(0);
-                        }
-                }
-
-                bytes += n_read;
-        } while (n_read);
+        struct counts cnt = {0};
+        int error = count_fd(fds[0], &cnt);
+        if (error) {
+                errno = error;
+                perror("wc read failed");
+        }
 
         int status = 0;
         wait(&status);
@@ -84,8 +562,49 @@ int main(int argc, char *argv[])
 
         close(fds[0]);
 
-        fprintf(stderr, "\t%ld\t%ld\t%ld\n", lines, words, bytes);
+        fprintf(stderr, "\t%zu\t%zu\t%zu\n", cnt.lines, cnt.words, cnt.bytes);
         return 0;
 }
 
+int
+main(int argc, char *argv[])
+{
+        count = count_select();
+        opts.n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        /* '+': stop at the first nonoption, the rest is the command to run */
+        int opt = 0;
+        while ((opt = getopt(argc, argv, "+ftp:j:")) != -1) {
+                switch (opt) {
+                case 'f':
+                        opts.files = 1;
+                        break;
+                case 't':
+                        opts.tee = 1;
+                        break;
+                case 'p':
+                        opts.period = atof(optarg);
+                        break;
+                case 'j':
+                        opts.n_threads = atol(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-t] [-p secs] [-j threads] -f [FILE]...\n"
+                                        "       %s [-t] [-p secs] COMMAND [ARG]...\n", argv[0], argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (opts.n_threads < 1)
+                opts.n_threads = 1;
+
+        if (opts.files)
+                return count_files(argc - optind, argv + optind);
 
+        if (optind == argc) {
+                fprintf(stderr, "wc: missing command operand\n");
+                return EXIT_FAILURE;
+        }
+
+        return count_command(argv + optind);
+}